@@ -7,10 +7,41 @@
 
 #define VSOCKS_VERSION              "1.05.1a"
 #define PROGRAM_SHORTCUT            "vsck"
+#define CACHE_LINE_SIZE             64
+#define POOL_MAX_SIZE               16384
 #define POOL_SIZE                   256
 #define LISTEN_BACKLOG              4
 #define POLL_TIMEOUT_MSEC           16000
+#define CONNECT_TIMEOUT_MSEC        10000
+#define HANDSHAKE_TIMEOUT_MSEC      16000
+#define GREETING_TIMEOUT_MSEC       5000
+#define REQUEST_TIMEOUT_MSEC        10000
+#define WARM_TTL_MSEC               10000
+#define WARM_PERIOD_MSEC            1000
+#define WARM_WINDOW_MSEC            250
+#define UPSTREAMS_MAX               16
+#define UPSTREAM_BACKOFF_MSEC       500
+#define UPSTREAM_BACKOFF_MAX_MSEC   30000
+#define IDLE_TIMEOUT_MSEC           3600000
+#define TIMER_TICK_MSEC             100
+#define TIMER_SLOT_BITS             8
+#define TIMER_SLOTS                 ( 1 << TIMER_SLOT_BITS )
+#define TIMER_LEVELS                2
 #define FORWARD_CHUNK_LEN           16384
+#define FORWARD_CHUNK_MIN           2048
+#define FORWARD_CHUNK_MAX           262144
 #define DATA_QUEUE_CAPACITY         384
+#define DATA_QUEUE_CHUNK            16
+#define DATA_QUEUE_MIN              64
+#define ZEROCOPY_THRESHOLD          10240
+#define ZEROCOPY_INFLIGHT           8
+#define SOCKMAP_ATTEMPTS            64
+#define SNDBUF_SAMPLE_PERIOD        64
+#define EDGE_BUDGET_BYTES           262144
+#define WORKERS_MAX                 64
+#define HANDOFF_QUEUE_LEN           1024
+#define REBALANCE_PERIOD_MSEC       1000
+#define REBALANCE_MIN_RATE          1048576
+#define REBALANCE_BATCH             8
 
 #endif
@@ -9,12 +9,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -33,6 +40,19 @@
 #define LEVEL_NONE                  0
 #define LEVEL_CONNECTING            111
 #define LEVEL_FORWARDING            123
+#define EDGE_NONE                   0
+#define EDGE_PENDING                1
+#define EDGE_ARMED                  2
+#define STREAM_IDLE                 0
+#define STREAM_HANDSHAKE            1
+#define STREAM_FORWARDING           2
+#define STREAM_ABANDONED            3
+#define STREAM_PARKED               4
+#define STREAM_STATES               5
+#define STREAM_ROLE_A               0
+#define STREAM_ROLE_B               1
+#define STREAM_ROLE_OTHER           2
+#define STREAM_ROLES                3
 #define EPOLLREF                    ((struct pollfd*) -1)
 #define STRADDR_SIZE                (INET_ADDRSTRLEN + INET6_ADDRSTRLEN + 16)
 
@@ -55,6 +75,25 @@
     }
 #endif
 
+struct proxy_t;
+struct stream_t;
+
+/**
+ * Forwarding mode operations, unset ones fall back to ring copy
+ */
+struct forward_ops_t
+{
+    int ( *setup ) ( struct proxy_t * proxy, struct stream_t * stream );
+    int ( *fill ) ( struct proxy_t * proxy, struct stream_t * stream );
+    int ( *drain ) ( struct proxy_t * proxy, struct stream_t * stream );
+    size_t ( *pending ) ( const struct stream_t * stream );
+    int ( *can_fill ) ( const struct stream_t * stream );
+    void ( *events ) ( struct stream_t * stream );
+    int ( *reap ) ( struct proxy_t * proxy, struct stream_t * stream );
+    int ( *intercept ) ( struct proxy_t * proxy, struct stream_t * stream );
+    void ( *settle ) ( struct proxy_t * proxy, struct stream_t * stream );
+};
+
 #define POLL_EVENTS_TO_4xSTR(EVENTS) \
     (EVENTS & POLLIN) ? "IN " : "", \
     (EVENTS & POLLOUT) ? "OUT " : "", \
@@ -75,31 +114,76 @@
 struct queue_t
 {
     size_t len;
-    uint8_t arr[DATA_QUEUE_CAPACITY];
+    size_t capacity;
+    uint8_t *arr;
+};
+
+/**
+ * Ring buffer structure
+ */
+struct ring_t
+{
+    size_t size;
+    size_t off;
+    size_t len;
+    size_t held;
+    uint8_t *arr;
+};
+
+/**
+ * Rarely used IP/TCP connection stream fields
+ */
+struct stream_cold_t
+{
+    struct queue_t queue;
+
+    /* additional params here */
 };
 
 /**
- * IP/TCP connection stream
+ * IP/TCP connection stream, fields used on every loop pass come first
  */
 struct stream_t
 {
     int role;
     int fd;
     int level;
+    int state;
+    int state_role;
     int allocated;
     int abandoned;
+    int edge;
+    int dirty;
+    int ready_queued;
+    int eof;
+    int sndfull;
     short events;
     short levents;
     short revents;
-
+    short ready;
     struct pollfd *pollref;
     struct stream_t *neighbour;
     struct stream_t *prev;
     struct stream_t *next;
-    struct queue_t queue;
+    struct stream_t *dirty_prev;
+    struct stream_t *dirty_next;
+    struct stream_t *state_prev;
+    struct stream_t *state_next;
+    size_t spent;
+
+    struct ring_t ring;
+    size_t chunk;
+    size_t fill_avg;
+    size_t sndbuf;
+    size_t forwarded;
+    uint64_t active;
+    unsigned int sndbuf_age;
+    int held;
+    const struct forward_ops_t *forward_ops;
+    struct stream_cold_t *cold;
 
     /* additional params here */
-};
+} __attribute__ ( ( aligned ( CACHE_LINE_SIZE ) ) );
 
 /**
  * Proxy base structure
@@ -107,11 +191,45 @@ struct stream_t
 struct proxy_t
 {
     size_t stream_size;
+    size_t cold_size;
     int verbose;
     int epoll_fd;
+    int edge_triggered;
+    int reuseport;
+    int fastopen;
+    size_t pool_size;
+    size_t pool_max;
+    size_t queue_capacity;
+    size_t chunk_len;
+    size_t chunk_min;
+    size_t chunk_max;
+    int poll_timeout;
+    size_t edge_budget;
+    size_t workers;
+    int wait_timeout;
+    void *event_list;
+    int edge_pending;
+    struct stream_t **ready_list;
+    size_t ready_len;
+    size_t forwarded;
+    int ( *watch_backend ) ( struct proxy_t * proxy );
+    const struct forward_ops_t *forward_ops;
     struct stream_t *stream_head;
     struct stream_t *stream_tail;
-    struct stream_t stream_pool[POOL_SIZE];
+    struct stream_t *dirty_head;
+    struct stream_t *state_head[STREAM_STATES];
+    size_t state_count[STREAM_STATES];
+    size_t role_count[STREAM_STATES][STREAM_ROLES];
+    size_t pool_capacity;
+    size_t slab_count;
+    uint8_t **slabs;
+    struct stream_t *free_head;
+    uint8_t *queue_free;
+    uint8_t *queue_chunks;
+    size_t queue_in_use;
+    uint64_t now;
+    size_t fastopen_acked;
+    size_t fastopen_fallback;
 
     /* additional params here */
 };
@@ -121,6 +239,11 @@ struct proxy_t
  */
 extern int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream );
 
+/**
+ * Handle stream state change, state is -1 once stream is removed
+ */
+extern void handle_stream_state ( struct proxy_t *proxy, struct stream_t *stream, int prev );
+
 #endif
 /* ------------------------------------------------------------------
  * Proxy Util - Source File
@@ -159,15 +282,45 @@ extern int listen_socket ( struct proxy_t *proxy, const struct sockaddr_storage
  */
 extern int socket_has_error ( int sock );
 
+/**
+ * Get socket send buffer size
+ */
+extern size_t socket_get_sndbuf ( int sock );
+
+/**
+ * Check if data sent with SYN was acknowledged
+ */
+extern int socket_fastopen_acked ( int sock );
+
 /**
  * Set socket non-blocking mode
  */
 extern int socket_set_nonblocking ( struct proxy_t *proxy, int sock );
 
 /**
- * Forward data between sockets
+ * Read socket input into ring buffer
+ */
+extern ssize_t socket_recv_ring ( int sock, struct ring_t *ring );
+
+/**
+ * Write ring buffer content into socket
+ */
+extern ssize_t socket_send_ring ( int sock, struct ring_t *ring, int flags );
+
+/**
+ * Prefer this listener for flows received on given CPU
  */
-extern int socket_forward_data ( struct proxy_t *proxy, int srcfd, int dstfd );
+extern int socket_set_incoming_cpu ( struct proxy_t *proxy, int sock, int cpu );
+
+/**
+ * Get CPU that received flow packets
+ */
+extern int socket_get_incoming_cpu ( int sock );
+
+/**
+ * Select reuseport group listener by receiving CPU modulo group size
+ */
+extern int socket_attach_cpu_selector ( struct proxy_t *proxy, int sock, unsigned int count );
 
 /**
  * Shutdown and close the socket
@@ -191,16 +344,90 @@ extern int queue_push ( struct queue_t *queue, const uint8_t * bytes, size_t len
  */
 extern int queue_set ( struct queue_t *queue, const uint8_t * bytes, size_t len );
 
+/**
+ * Drop leading bytes from data queue
+ */
+extern void queue_drop ( struct queue_t *queue, size_t len );
+
 /**
  * Shift bytes from data queue
  */
 extern int queue_shift ( struct queue_t *queue, int fd );
 
+/**
+ * Take handshake queue for the stream from the arena
+ */
+extern int stream_queue_acquire ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Return handshake queue of the stream to the arena
+ */
+extern void stream_queue_release ( struct proxy_t *proxy, struct stream_t *stream );
+
 /**
  * Assert minimum data length
  */
 extern int check_enough_data ( struct proxy_t *proxy, struct stream_t *stream, size_t value );
 
+/* NOTE: Ring Buffer Related Functions */
+
+/**
+ * Allocate ring buffer storage
+ */
+extern int ring_alloc ( struct ring_t *ring, size_t size );
+
+/**
+ * Release ring buffer storage
+ */
+extern void ring_free ( struct ring_t *ring );
+
+/**
+ * Change ring buffer storage size while empty
+ */
+extern int ring_resize ( struct ring_t *ring, size_t size );
+
+/* NOTE: Proxy Tunables Related Functions */
+
+/**
+ * Get monotonic time in milliseconds
+ */
+extern uint64_t get_monotonic_msec ( void );
+
+/**
+ * Get monotonic time in microseconds
+ */
+extern uint64_t get_monotonic_usec ( void );
+
+/**
+ * Set proxy tunables to default values
+ */
+extern void proxy_set_defaults ( struct proxy_t *proxy );
+
+/**
+ * Parse proxy tunable in name=value form
+ */
+extern int proxy_set_tunable ( struct proxy_t *proxy, const char *input );
+
+/**
+ * Complete unset limits and validate tunables once all are parsed
+ */
+extern int proxy_check_tunables ( struct proxy_t *proxy );
+
+/**
+ * Allocate stream pool with the first slab
+ */
+extern int proxy_pool_alloc ( struct proxy_t *proxy );
+
+/**
+ * Add a slab of streams to the free list
+ */
+extern int proxy_pool_grow ( struct proxy_t *proxy );
+
+/**
+ * Release stream pool slabs
+ */
+extern void proxy_pool_free ( struct proxy_t *proxy );
+
 /* NOTE: Event Listenning Related Functions */
 
 /**
@@ -208,6 +435,16 @@ extern int check_enough_data ( struct proxy_t *proxy, struct stream_t *stream, s
  */
 extern int proxy_events_setup ( struct proxy_t *proxy );
 
+/**
+ * Release proxy events listenning
+ */
+extern void proxy_events_free ( struct proxy_t *proxy );
+
+/**
+ * Queue stream with returned events for dispatch
+ */
+extern void stream_push_ready ( struct proxy_t *proxy, struct stream_t *stream );
+
 /**
  * Build stream event list with poll
  */
@@ -255,16 +492,51 @@ extern int watch_streams ( struct proxy_t *proxy );
 
 /* NOTE: Stream Related Functions */
 
+/**
+ * Return stream slot to the free list
+ */
+extern void stream_release_slot ( struct proxy_t *proxy, struct stream_t *stream );
+
 /**
  * Insert new stream structure into the list
  */
 extern struct stream_t *insert_stream ( struct proxy_t *proxy, int sock );
 
+/**
+ * Move stream into the list of given state
+ */
+extern void stream_set_state ( struct proxy_t *proxy, struct stream_t *stream, int state );
+
+/**
+ * Queue stream for events interest sync
+ */
+extern void stream_mark_dirty ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Drop stream from events interest sync queue
+ */
+extern void stream_clear_dirty ( struct proxy_t *proxy, struct stream_t *stream );
+
 /**
  * Accept a new stream
  */
 extern struct stream_t *accept_new_stream ( struct proxy_t *proxy, int lfd );
 
+/**
+ * Switch relation into forwarding mode
+ */
+extern int setup_forwarding ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Get count of stream input bytes ahead
+ */
+extern size_t stream_pending_data ( const struct stream_t *stream );
+
+/**
+ * Mark stream socket send buffer as full
+ */
+extern void stream_mark_full ( struct stream_t *stream );
+
 /**
  * Handle stream data forward
  */
@@ -283,18 +555,13 @@ extern void remove_stream ( struct proxy_t *proxy, struct stream_t *stream );
 /*
  * Abandon associated pair of streams
  */
-extern void remove_relation ( struct stream_t *stream );
+extern void remove_relation ( struct proxy_t *proxy, struct stream_t *stream );
 
 /**
  * Remove all relations
  */
 extern void remove_all_streams ( struct proxy_t *proxy );
 
-/**
- * Remove pending streams
- */
-extern void remove_pending_streams ( struct proxy_t *proxy );
-
 /**
  * Remove abandoned streams
  */
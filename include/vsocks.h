@@ -9,10 +9,36 @@
 #include "config.h"
 
 #define L_ACCEPT                    3
+#define L_STOP                      4
+#define L_HANDOFF                   5
+#define URINGREF                    ((struct pollfd*) -2)
+#define URINGSTOP                   ((struct pollfd*) -3)
 
 #define LEVEL_AWAITING              1
 #define LEVEL_SOCKS_VER             3
 #define LEVEL_SOCKS_REQ             4
+#define LEVEL_WARM                  5
+#define S_PORT_W                    300
+#define FORWARD_COPY                0
+#define FORWARD_SPLICE              1
+#define FORWARD_ZEROCOPY            2
+#define FORWARD_SOCKMAP             3
+#define SOCKS_REQUEST_LEN_MAX       22
+#define SOCKS_REP_NET_UNREACH       3
+#define SOCKS_REP_TTL_EXPIRED       6
+#define STREAM_STATES               5
+#define STREAM_ROLES                3
+#define BALANCE_RR                  1
+#define BALANCE_LEAST               2
+#define BALANCE_EWMA                3
+#define TIMEOUT_CONNECT             0
+#define TIMEOUT_GREETING            1
+#define TIMEOUT_REQUEST             2
+#define TIMEOUT_HANDSHAKE           3
+#define TIMEOUT_IDLE                4
+#define TIMEOUT_LIFETIME            5
+#define TIMEOUT_STALE               6
+#define TIMEOUT_REASONS             7
 
 /**
  * Data queue structure
@@ -20,28 +46,147 @@
 struct queue_t
 {
     size_t len;
-    uint8_t arr[DATA_QUEUE_CAPACITY];
+    size_t capacity;
+    uint8_t *arr;
 };
 
 /**
- * IP/TCP connection stream
+ * Ring buffer structure
+ */
+struct ring_t
+{
+    size_t size;
+    size_t off;
+    size_t len;
+    size_t held;
+    uint8_t *arr;
+};
+
+/**
+ * Socket map key structure
+ */
+struct sockmap_key_t
+{
+    uint32_t remote_ip;
+    uint32_t local_port;
+    uint32_t remote_port;
+};
+
+/**
+ * IO-uring instance structure
+ */
+struct uring_t
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *sqes;
+    void *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    size_t sqes_len;
+};
+
+/**
+ * Rarely used IP/TCP connection stream fields
+ */
+struct stream_cold_t
+{
+    struct queue_t queue;
+
+    uint64_t created;
+    uint64_t stage_deadline;
+    int stage_reason;
+    struct sockaddr_storage dest;
+    int dest_known;
+    int upstream;
+    int bound;
+    uint64_t upstream_stamp;
+};
+
+/**
+ * IP/TCP connection stream, fields used on every loop pass come first
  */
 struct stream_t
 {
     int role;
     int fd;
     int level;
+    int state;
+    int state_role;
     int allocated;
     int abandoned;
+    int edge;
+    int dirty;
+    int ready_queued;
+    int eof;
+    int sndfull;
     short events;
     short levents;
     short revents;
-
+    short ready;
     struct pollfd *pollref;
     struct stream_t *neighbour;
     struct stream_t *prev;
     struct stream_t *next;
-    struct queue_t queue;
+    struct stream_t *dirty_prev;
+    struct stream_t *dirty_next;
+    struct stream_t *state_prev;
+    struct stream_t *state_next;
+    size_t spent;
+
+    struct ring_t ring;
+    size_t chunk;
+    size_t fill_avg;
+    size_t sndbuf;
+    size_t forwarded;
+    uint64_t active;
+    unsigned int sndbuf_age;
+    int held;
+    const struct forward_ops_t *forward_ops;
+    struct stream_cold_t *cold;
+
+    uint64_t expires;
+    struct stream_t *timer_prev;
+    struct stream_t *timer_next;
+    int timer_armed;
+    short timer_level;
+    short timer_slot;
+    int pipefull;
+    int pipefd[2];
+    unsigned int piped;
+    unsigned int pipecap;
+    int zerocopy;
+    int sockmap;
+    unsigned int zc_next;
+    unsigned int zc_head;
+    unsigned int zc_count;
+    unsigned int zc_id[ZEROCOPY_INFLIGHT];
+    unsigned int zc_len[ZEROCOPY_INFLIGHT];
+    uint8_t zc_done[ZEROCOPY_INFLIGHT];
+} __attribute__ ( ( aligned ( CACHE_LINE_SIZE ) ) );
+
+/**
+ * Upstream socks server with its statistics
+ */
+struct upstream_t
+{
+    struct sockaddr_storage saddr;
+    size_t active;
+    size_t relations;
+    size_t handshakes;
+    size_t failures;
+    size_t failed;
+    uint64_t latency;
+    uint64_t retry_at;
 };
 
 /**
@@ -50,14 +195,121 @@ struct stream_t
 struct proxy_t
 {
     size_t stream_size;
+    size_t cold_size;
     int verbose;
     int epoll_fd;
+    int edge_triggered;
+    int reuseport;
+    int fastopen;
+    size_t pool_size;
+    size_t pool_max;
+    size_t queue_capacity;
+    size_t chunk_len;
+    size_t chunk_min;
+    size_t chunk_max;
+    int poll_timeout;
+    size_t edge_budget;
+    size_t workers;
+    int wait_timeout;
+    void *event_list;
+    int edge_pending;
+    struct stream_t **ready_list;
+    size_t ready_len;
+    size_t forwarded;
+    int ( *watch_backend ) ( struct proxy_t * proxy );
+    const struct forward_ops_t *forward_ops;
     struct stream_t *stream_head;
     struct stream_t *stream_tail;
-    struct stream_t stream_pool[POOL_SIZE];
+    struct stream_t *dirty_head;
+    struct stream_t *state_head[STREAM_STATES];
+    size_t state_count[STREAM_STATES];
+    size_t role_count[STREAM_STATES][STREAM_ROLES];
+    size_t pool_capacity;
+    size_t slab_count;
+    uint8_t **slabs;
+    struct stream_t *free_head;
+    uint8_t *queue_free;
+    uint8_t *queue_chunks;
+    size_t queue_in_use;
+    uint64_t now;
+    size_t fastopen_acked;
+    size_t fastopen_fallback;
 
     struct sockaddr_storage entrance;
-    struct sockaddr_storage socks5;
+    int prefer_uring;
+    struct uring_t uring;
+    int forward_mode;
+    int sockmap_fd;
+    int sockmap_parser_fd;
+    int sockmap_verdict_fd;
+    int connect_timeout;
+    int handshake_timeout;
+    int idle_timeout;
+    int lifetime;
+    int greeting_timeout;
+    int request_timeout;
+    size_t warm_max;
+    int warm_ttl;
+    int balance;
+    uint64_t wheel_tick;
+    size_t timer_count;
+    size_t timeouts[TIMEOUT_REASONS];
+    uint64_t wheel_map[TIMER_LEVELS][TIMER_SLOTS / 64];
+    struct stream_t *wheel[TIMER_LEVELS][TIMER_SLOTS];
+    struct upstream_t upstreams[UPSTREAMS_MAX];
+    size_t upstream_count;
+    size_t upstream_next;
+    int stop_fd;
+    int stopped;
+    int acceptor;
+    struct handoff_queue_t *handoff;
+    struct handoff_queue_t *migrate_target;
+    size_t migrate_rate;
+    uint64_t rate_stamp;
+    int steering;
+    int listen_fd;
+    int pipelined;
+    int early_data;
+    size_t warm_accepts;
+    size_t warm_opened;
+    size_t warm_rate;
+    uint64_t warm_stamp;
+};
+
+#define HANDOFF_ACCEPTED            0
+#define HANDOFF_MIGRATED            1
+
+/**
+ * Relation handed off between threads, accepted ones carry no upstream yet
+ */
+struct handoff_t
+{
+    int kind;
+    int a_fd;
+    int b_fd;
+    int upstream;
+    struct sockaddr_storage dest;
+};
+
+/**
+ * Hand-off queue slot
+ */
+struct handoff_slot_t
+{
+    size_t seq;
+    struct handoff_t item;
+};
+
+/**
+ * Bounded lock-free hand-off queue, many producers and one consumer
+ */
+struct handoff_queue_t
+{
+    size_t mask;
+    size_t head;
+    size_t tail;
+    int event_fd;
+    struct handoff_slot_t *slots;
 };
 
 /**
@@ -65,6 +317,117 @@ struct proxy_t
  */
 extern int proxy_task ( struct proxy_t *params );
 
+/**
+ * Obtain original address and port from iptables redirect
+ */
+extern int get_original_dest ( int sock, struct sockaddr_storage *saddr );
+
+/**
+ * Run proxy task in worker threads
+ */
+extern int run_workers ( struct proxy_t *proxy, int count );
+
+/**
+ * Setup hand-off queue with wakeup event
+ */
+extern int handoff_queue_init ( struct handoff_queue_t *queue, size_t capacity );
+
+/**
+ * Release hand-off queue, closing relations left inside
+ */
+extern void handoff_queue_free ( struct handoff_queue_t *queue );
+
+/**
+ * Enqueue relation and wake consumer up
+ */
+extern int handoff_push ( struct handoff_queue_t *queue, const struct handoff_t *item );
+
+/**
+ * Dequeue relation, consumer side only
+ */
+extern int handoff_pop ( struct handoff_queue_t *queue, struct handoff_t *item );
+
+/**
+ * Get count of relations waiting in the queue
+ */
+extern size_t handoff_queue_len ( struct handoff_queue_t *queue );
+
+/**
+ * Select forwarding operations for preferred mode
+ */
+extern void forward_ops_init ( struct proxy_t *proxy );
+
+/**
+ * Release forwarding mode resources
+ */
+extern void forward_ops_free ( struct proxy_t *proxy );
+
+/**
+ * Track forwarding mode resources across stream lifetime
+ */
+extern void forward_stream_state ( struct proxy_t *proxy, struct stream_t *stream, int prev );
+
+/**
+ * Use io_uring polls for events if preferred and supported
+ */
+extern void uring_events_setup ( struct proxy_t *proxy );
+
+/**
+ * Release io_uring instance
+ */
+extern void uring_free ( struct proxy_t *proxy );
+
+/**
+ * Queue stream poll cancellation with io_uring
+ */
+extern int uring_poll_remove ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Charge failed relation handshake to its upstream
+ */
+extern void fail_upstream_handshake ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Reset timer wheel to current time
+ */
+extern void timer_wheel_init ( struct proxy_t *proxy );
+
+/**
+ * Remove stream from the timer wheel
+ */
+extern void stream_timer_cancel ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Put stream on the timer wheel, replacing its current deadline
+ */
+extern void stream_timer_arm ( struct proxy_t *proxy, struct stream_t *stream, uint64_t expires );
+
+/**
+ * Enter handshake stage with its own deadline
+ */
+extern void stream_set_stage ( struct proxy_t *proxy, struct stream_t *stream, int level,
+    int timeout, int reason );
+
+/**
+ * Arm stream timer for its current state
+ */
+extern void stream_timer_update ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Advance timer wheel to current time, expiring due streams
+ */
+extern void timer_wheel_advance ( struct proxy_t *proxy );
+
+/**
+ * Get events wait timeout bounded by the next deadline
+ */
+extern int timer_wait_msec ( struct proxy_t *proxy );
+
+/**
+ * Show timeouts statistics
+ */
+extern void show_timer_stats ( struct proxy_t *proxy );
+
 #include "util.h"
 
 #endif
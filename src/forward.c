@@ -0,0 +1,936 @@
+/* ------------------------------------------------------------------
+ * V-Socks - Forwarding Modes Source Code
+ * ------------------------------------------------------------------ */
+
+#define _GNU_SOURCE
+#include "vsocks.h"
+
+/* NOTE: Splice Forwarding Related Functions */
+
+/**
+ * Move data from socket into stream pipe
+ */
+static int splice_socket_to_pipe ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    size_t len;
+    ssize_t status;
+
+    len = stream->pipecap - stream->piped;
+
+    if ( len > stream->chunk )
+    {
+        len = stream->chunk;
+    }
+
+    if ( ( status = splice ( stream->fd, NULL, stream->pipefd[1], NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK ) ) < 0 )
+    {
+        if ( errno == EAGAIN )
+        {
+            /* Pipe may be out of buffers while still holding data */
+            stream->pipefull = !!stream->piped;
+            return 0;
+        }
+
+        failure ( "cannot splice data (%i) from socket:%i\n", errno, stream->fd );
+        return -1;
+    }
+
+    if ( !status )
+    {
+        verbose ( "lost connection on socket:%i\n", stream->fd );
+        stream->eof = 1;
+        return 0;
+    }
+
+    stream->piped += status;
+
+    verbose ( "spliced %i byte(s) from socket:%i into pipe\n", ( int ) status, stream->fd );
+
+    return status;
+}
+
+/**
+ * Move data from stream pipe into neighbour socket
+ */
+static int splice_pipe_to_socket ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    ssize_t status;
+
+    if ( !stream->piped )
+    {
+        return 0;
+    }
+
+    if ( ( status = splice ( stream->pipefd[0], NULL, stream->neighbour->fd, NULL, stream->piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK ) ) < 0 )
+    {
+        if ( errno == EAGAIN )
+        {
+            return 0;
+        }
+
+        failure ( "cannot splice data (%i) into socket:%i\n", errno, stream->neighbour->fd );
+        return -1;
+    }
+
+    stream->piped -= status;
+    stream->pipefull = 0;
+
+    verbose ( "spliced %i byte(s) from socket:%i to socket:%i\n", ( int ) status, stream->fd,
+        stream->neighbour->fd );
+
+    return status;
+}
+
+/**
+ * Create forwarding pipe for a stream
+ */
+static int stream_pipe_open ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int size;
+
+    if ( pipe2 ( stream->pipefd, O_NONBLOCK ) < 0 )
+    {
+        failure ( "cannot create pipe (%i) for socket:%i\n", errno, stream->fd );
+        stream->pipefd[0] = -1;
+        stream->pipefd[1] = -1;
+        return -1;
+    }
+
+    if ( ( size = fcntl ( stream->pipefd[0], F_GETPIPE_SZ ) ) <= 0 )
+    {
+        size = proxy->chunk_len;
+    }
+
+    stream->pipecap = ( unsigned int ) size;
+    stream->piped = 0;
+    stream->pipefull = 0;
+
+    verbose ( "created pipe of %i byte(s) for socket:%i\n", size, stream->fd );
+
+    return 0;
+}
+
+/**
+ * Close forwarding pipe of a stream
+ */
+static void stream_pipe_close ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    UNUSED ( proxy );
+
+    if ( stream->pipefd[0] >= 0 )
+    {
+        close ( stream->pipefd[0] );
+        stream->pipefd[0] = -1;
+    }
+
+    if ( stream->pipefd[1] >= 0 )
+    {
+        close ( stream->pipefd[1] );
+        stream->pipefd[1] = -1;
+    }
+
+    stream->piped = 0;
+}
+
+/**
+ * Get count of stream bytes held in its pipe
+ */
+static size_t splice_pending ( const struct stream_t *stream )
+{
+    return stream->piped;
+}
+
+/**
+ * Check if stream pipe can take more input
+ */
+static int splice_can_fill ( const struct stream_t *stream )
+{
+    return !stream->pipefull && stream->piped < stream->pipecap;
+}
+
+/**
+ * Move bytes left in handshake queue into stream pipe
+ */
+static int splice_carry_queue ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    ssize_t len;
+    struct queue_t *queue = &stream->cold->queue;
+
+    if ( !queue->len )
+    {
+        return 0;
+    }
+
+    /* Fresh pipe always has room for a handshake queue */
+    if ( ( len = write ( stream->pipefd[1], queue->arr, queue->len ) ) < 0
+        || ( size_t ) len < queue->len )
+    {
+        failure ( "cannot carry handshake data (%i) on socket:%i\n", errno, stream->fd );
+        return -1;
+    }
+
+    stream->piped += len;
+
+    verbose ( "carried %i byte(s) of handshake data from socket:%i\n", ( int ) len, stream->fd );
+
+    /* Neighbour has data to take as soon as it is writable */
+    stream->neighbour->events |= POLLOUT;
+    queue_reset ( queue );
+
+    return 0;
+}
+
+static const struct forward_ops_t splice_ops;
+
+/**
+ * Take relation over with pipe pair if nothing was buffered ahead
+ */
+static int splice_setup ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    struct stream_t *neighbour = stream->neighbour;
+
+    if ( stream->ring.len || neighbour->ring.len )
+    {
+        return 0;
+    }
+
+    if ( stream_pipe_open ( proxy, stream ) < 0 || stream_pipe_open ( proxy, neighbour ) < 0 )
+    {
+        stream_pipe_close ( proxy, stream );
+        stream_pipe_close ( proxy, neighbour );
+        verbose ( "falling back to copy forwarding on socket:%i\n", stream->fd );
+        return 0;
+    }
+
+    stream->forward_ops = &splice_ops;
+    neighbour->forward_ops = &splice_ops;
+
+    /* Rings set up ahead of forwarding are not needed */
+    ring_free ( &stream->ring );
+    ring_free ( &neighbour->ring );
+
+    if ( splice_carry_queue ( proxy, stream ) < 0 || splice_carry_queue ( proxy, neighbour ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Handshake data is no longer needed */
+    stream_queue_release ( proxy, stream );
+    stream_queue_release ( proxy, neighbour );
+
+    return 1;
+}
+
+static const struct forward_ops_t splice_ops = {
+    .setup = splice_setup,
+    .fill = splice_socket_to_pipe,
+    .drain = splice_pipe_to_socket,
+    .pending = splice_pending,
+    .can_fill = splice_can_fill
+};
+
+/* NOTE: Zerocopy Forwarding Related Functions */
+
+/**
+ * Enable zerocopy transmission on socket
+ */
+static int socket_enable_zerocopy ( struct proxy_t *proxy, int sock )
+{
+    int yes = 1;
+
+    if ( setsockopt ( sock, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof ( yes ) ) < 0 )
+    {
+        verbose ( "cannot enable zerocopy (%i) on socket:%i\n", errno, sock );
+        return -1;
+    }
+
+    verbose ( "enabled zerocopy on socket:%i\n", sock );
+
+    return 0;
+}
+
+/**
+ * Account stream ring data sent to neighbour
+ */
+static void zerocopy_hold ( struct stream_t *stream, size_t len, int zerocopy )
+{
+    unsigned int last;
+
+    if ( zerocopy )
+    {
+        /* Each zerocopy send gets next notification id */
+        last = ( stream->zc_head + stream->zc_count ) % ZEROCOPY_INFLIGHT;
+        stream->zc_id[last] = stream->zc_next++;
+        stream->zc_len[last] = len;
+        stream->zc_done[last] = 0;
+        stream->zc_count++;
+        stream->ring.held += len;
+
+    } else if ( stream->zc_count )
+    {
+        /* Copied data is released along with preceding zerocopy send */
+        last = ( stream->zc_head + stream->zc_count - 1 ) % ZEROCOPY_INFLIGHT;
+        stream->zc_len[last] += len;
+        stream->ring.held += len;
+    }
+}
+
+/**
+ * Release stream ring data once zerocopy sends completed
+ */
+static void zerocopy_release ( struct stream_t *stream, unsigned int lo, unsigned int hi )
+{
+    unsigned int i;
+    unsigned int index;
+
+    /* Mark completed sends, ids may wrap around */
+    for ( i = 0; i < stream->zc_count; i++ )
+    {
+        index = ( stream->zc_head + i ) % ZEROCOPY_INFLIGHT;
+
+        if ( stream->zc_id[index] - lo <= hi - lo )
+        {
+            stream->zc_done[index] = 1;
+        }
+    }
+
+    /* Release data in order of sending */
+    while ( stream->zc_count && stream->zc_done[stream->zc_head] )
+    {
+        stream->ring.held -= stream->zc_len[stream->zc_head];
+        stream->zc_head = ( stream->zc_head + 1 ) % ZEROCOPY_INFLIGHT;
+        stream->zc_count--;
+    }
+}
+
+/**
+ * Read zerocopy completions from socket error queue
+ */
+static int socket_reap_zerocopy ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int count = 0;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+    uint8_t control[256];
+
+    for ( ;; )
+    {
+        memset ( &msg, '\0', sizeof ( msg ) );
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof ( control );
+
+        if ( recvmsg ( stream->fd, &msg, MSG_ERRQUEUE ) < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                return count;
+            }
+
+            failure ( "cannot read error queue (%i) of socket:%i\n", errno, stream->fd );
+            return -1;
+        }
+
+        for ( cmsg = CMSG_FIRSTHDR ( &msg ); cmsg; cmsg = CMSG_NXTHDR ( &msg, cmsg ) )
+        {
+            if ( !( cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR )
+                && !( cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR ) )
+            {
+                continue;
+            }
+
+            serr = ( struct sock_extended_err * ) CMSG_DATA ( cmsg );
+
+            if ( serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno )
+            {
+                continue;
+            }
+
+            verbose ( "zerocopy sends %u-%u completed on socket:%i\n", serr->ee_info,
+                serr->ee_data, stream->fd );
+
+            zerocopy_release ( stream->neighbour, serr->ee_info, serr->ee_data );
+
+            /* Kernel had to copy data anyway, stop paying for notifications */
+            if ( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+            {
+                if ( stream->zerocopy )
+                {
+                    verbose ( "zerocopy fell back to copy on socket:%i\n", stream->fd );
+                }
+                stream->zerocopy = 0;
+            }
+
+            count++;
+        }
+    }
+}
+
+/**
+ * Pass stream ring to neighbour, large bursts without copying
+ */
+static int zerocopy_drain ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int flags = 0;
+    ssize_t len;
+
+    /* Use zerocopy only if worth it and completion can be tracked */
+    if ( stream->neighbour->zerocopy && stream->ring.len >= ZEROCOPY_THRESHOLD
+        && stream->zc_count < ZEROCOPY_INFLIGHT )
+    {
+        flags = MSG_ZEROCOPY;
+    }
+
+    if ( ( len = socket_send_ring ( stream->neighbour->fd, &stream->ring, flags ) ) < 0
+        && errno == ENOBUFS && flags )
+    {
+        verbose ( "zerocopy out of buffers on socket:%i\n", stream->neighbour->fd );
+        flags = 0;
+        len = socket_send_ring ( stream->neighbour->fd, &stream->ring, 0 );
+    }
+
+    if ( len < 0 )
+    {
+        if ( errno == EAGAIN )
+        {
+            return 0;
+        }
+
+        failure ( "cannot send data (%i) to socket:%i\n", errno, stream->neighbour->fd );
+        return -1;
+    }
+
+    zerocopy_hold ( stream, len, flags );
+
+    verbose ( "forwarded %i byte(s) from socket:%i to socket:%i\n", ( int ) len, stream->fd,
+        stream->neighbour->fd );
+
+    return len;
+}
+
+/**
+ * Stay watched while zerocopy completions are due
+ */
+static void zerocopy_events ( struct stream_t *stream )
+{
+    if ( stream->neighbour->zc_count )
+    {
+        stream->events |= POLLERR;
+    }
+}
+
+/**
+ * Take zerocopy completions off socket error report
+ */
+static int zerocopy_reap ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( !stream->neighbour || !stream->neighbour->zc_count )
+    {
+        return -1;
+    }
+
+    if ( socket_reap_zerocopy ( proxy, stream ) < 0 || socket_has_error ( stream->fd ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static const struct forward_ops_t zerocopy_ops;
+
+/**
+ * Enable zerocopy on relation sockets, rings are kept for sending
+ */
+static int zerocopy_setup ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    struct stream_t *neighbour = stream->neighbour;
+
+    stream->zerocopy = socket_enable_zerocopy ( proxy, stream->fd ) >= 0;
+    neighbour->zerocopy = socket_enable_zerocopy ( proxy, neighbour->fd ) >= 0;
+
+    if ( stream->zerocopy || neighbour->zerocopy )
+    {
+        stream->forward_ops = &zerocopy_ops;
+        neighbour->forward_ops = &zerocopy_ops;
+    }
+
+    return 0;
+}
+
+static const struct forward_ops_t zerocopy_ops = {
+    .setup = zerocopy_setup,
+    .drain = zerocopy_drain,
+    .events = zerocopy_events,
+    .reap = zerocopy_reap
+};
+
+/* NOTE: Socket Map Forwarding Related Functions */
+
+#define SOCKMAP_INSN(CODE, DST, SRC, OFF, IMM) \
+    { .code = ( CODE ), .dst_reg = ( DST ), .src_reg = ( SRC ), .off = ( OFF ), .imm = ( IMM ) }
+
+/**
+ * Invoke bpf system call
+ */
+static int sockmap_bpf ( int cmd, union bpf_attr *attr )
+{
+    return syscall ( __NR_bpf, cmd, attr, sizeof ( union bpf_attr ) );
+}
+
+/**
+ * Load socket map program
+ */
+static int sockmap_load_prog ( struct proxy_t *proxy, const struct bpf_insn *insns, size_t count )
+{
+    int fd;
+    union bpf_attr attr;
+    char log[4096];
+
+    memset ( &attr, '\0', sizeof ( attr ) );
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = ( uint64_t ) ( uintptr_t ) insns;
+    attr.insn_cnt = count;
+    attr.license = ( uint64_t ) ( uintptr_t ) "GPL";
+
+    if ( ( fd = sockmap_bpf ( BPF_PROG_LOAD, &attr ) ) >= 0 )
+    {
+        return fd;
+    }
+
+    failure ( "cannot load sockmap program (%i)\n", errno );
+
+    /* Load again to get verifier log */
+    if ( proxy->verbose )
+    {
+        attr.log_buf = ( uint64_t ) ( uintptr_t ) log;
+        attr.log_size = sizeof ( log );
+        attr.log_level = 1;
+        log[0] = '\0';
+
+        if ( ( fd = sockmap_bpf ( BPF_PROG_LOAD, &attr ) ) >= 0 )
+        {
+            close ( fd );
+        }
+
+        verbose ( "verifier says: %s\n", log );
+    }
+
+    return -1;
+}
+
+/**
+ * Attach socket map program
+ */
+static int sockmap_attach_prog ( int map_fd, int prog_fd, int type )
+{
+    union bpf_attr attr;
+
+    memset ( &attr, '\0', sizeof ( attr ) );
+    attr.target_fd = map_fd;
+    attr.attach_bpf_fd = prog_fd;
+    attr.attach_type = type;
+
+    return sockmap_bpf ( BPF_PROG_ATTACH, &attr );
+}
+
+/**
+ * Load socket map stream parser program
+ */
+static int sockmap_load_parser ( struct proxy_t *proxy )
+{
+    /* Whole skb makes single message */
+    struct bpf_insn parser[] = {
+        SOCKMAP_INSN ( BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1,
+            offsetof ( struct __sk_buff, len ), 0 ),
+        SOCKMAP_INSN ( BPF_JMP | BPF_EXIT, 0, 0, 0, 0 )
+    };
+
+    return sockmap_load_prog ( proxy, parser, sizeof ( parser ) / sizeof ( struct bpf_insn ) );
+}
+
+/**
+ * Load socket map stream verdict program
+ */
+static int sockmap_load_verdict ( struct proxy_t *proxy )
+{
+    /* Receiving socket key maps to its neighbour, unknown keys pass to user space */
+    struct bpf_insn verdict[] = {
+        SOCKMAP_INSN ( BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0 ),
+        SOCKMAP_INSN ( BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+            offsetof ( struct __sk_buff, family ), 0 ),
+        SOCKMAP_INSN ( BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 2, AF_INET ),
+        SOCKMAP_INSN ( BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6,
+            offsetof ( struct __sk_buff, remote_ip4 ), 0 ),
+        SOCKMAP_INSN ( BPF_JMP | BPF_JA, 0, 0, 1, 0 ),
+        SOCKMAP_INSN ( BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6,
+            offsetof ( struct __sk_buff, remote_ip6[3] ), 0 ),
+        SOCKMAP_INSN ( BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -12, 0 ),
+        SOCKMAP_INSN ( BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6,
+            offsetof ( struct __sk_buff, local_port ), 0 ),
+        SOCKMAP_INSN ( BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -8, 0 ),
+        SOCKMAP_INSN ( BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6,
+            offsetof ( struct __sk_buff, remote_port ), 0 ),
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+        SOCKMAP_INSN ( BPF_ALU | BPF_RSH | BPF_K, BPF_REG_3, 0, 0, 16 ),
+#endif
+        SOCKMAP_INSN ( BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -4, 0 ),
+        SOCKMAP_INSN ( BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 ),
+        SOCKMAP_INSN ( BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0,
+            proxy->sockmap_fd ),
+        SOCKMAP_INSN ( 0, 0, 0, 0, 0 ),
+        SOCKMAP_INSN ( BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0 ),
+        SOCKMAP_INSN ( BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -12 ),
+        SOCKMAP_INSN ( BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0 ),
+        SOCKMAP_INSN ( BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash ),
+        SOCKMAP_INSN ( BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 1, SK_DROP ),
+        SOCKMAP_INSN ( BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS ),
+        SOCKMAP_INSN ( BPF_JMP | BPF_EXIT, 0, 0, 0, 0 )
+    };
+
+    return sockmap_load_prog ( proxy, verdict, sizeof ( verdict ) / sizeof ( struct bpf_insn ) );
+}
+
+/**
+ * Release socket map and programs
+ */
+static void sockmap_free ( struct proxy_t *proxy )
+{
+    if ( proxy->sockmap_verdict_fd >= 0 )
+    {
+        close ( proxy->sockmap_verdict_fd );
+        proxy->sockmap_verdict_fd = -1;
+    }
+
+    if ( proxy->sockmap_parser_fd >= 0 )
+    {
+        close ( proxy->sockmap_parser_fd );
+        proxy->sockmap_parser_fd = -1;
+    }
+
+    if ( proxy->sockmap_fd >= 0 )
+    {
+        close ( proxy->sockmap_fd );
+        proxy->sockmap_fd = -1;
+    }
+}
+
+/**
+ * Setup socket map with redirect programs
+ */
+static int sockmap_setup ( struct proxy_t *proxy )
+{
+    union bpf_attr attr;
+
+    memset ( &attr, '\0', sizeof ( attr ) );
+    attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+    attr.key_size = sizeof ( struct sockmap_key_t );
+    attr.value_size = sizeof ( uint32_t );
+    attr.max_entries = proxy->pool_max;
+
+    if ( ( proxy->sockmap_fd = sockmap_bpf ( BPF_MAP_CREATE, &attr ) ) < 0 )
+    {
+        failure ( "cannot create socket map (%i)\n", errno );
+        return -1;
+    }
+
+    if ( ( proxy->sockmap_parser_fd = sockmap_load_parser ( proxy ) ) < 0
+        || ( proxy->sockmap_verdict_fd = sockmap_load_verdict ( proxy ) ) < 0 )
+    {
+        sockmap_free ( proxy );
+        return -1;
+    }
+
+    if ( sockmap_attach_prog ( proxy->sockmap_fd, proxy->sockmap_parser_fd,
+            BPF_SK_SKB_STREAM_PARSER ) < 0
+        || sockmap_attach_prog ( proxy->sockmap_fd, proxy->sockmap_verdict_fd,
+            BPF_SK_SKB_STREAM_VERDICT ) < 0 )
+    {
+        failure ( "cannot attach sockmap programs (%i)\n", errno );
+        sockmap_free ( proxy );
+        return -1;
+    }
+
+    verbose ( "socket map initialized\n" );
+
+    return 0;
+}
+
+/**
+ * Build socket map key of a connected socket
+ */
+static int sockmap_build_key ( int sock, struct sockmap_key_t *key )
+{
+    socklen_t len;
+    struct sockaddr_storage local;
+    struct sockaddr_storage remote;
+
+    len = sizeof ( local );
+    if ( getsockname ( sock, ( struct sockaddr * ) &local, &len ) < 0 )
+    {
+        return -1;
+    }
+
+    len = sizeof ( remote );
+    if ( getpeername ( sock, ( struct sockaddr * ) &remote, &len ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Same representation as seen by the verdict program */
+    switch ( remote.ss_family )
+    {
+    case AF_INET:
+        memcpy ( &key->remote_ip, &( ( struct sockaddr_in * ) &remote )->sin_addr, 4 );
+        key->remote_port = ( ( struct sockaddr_in * ) &remote )->sin_port;
+        key->local_port = ntohs ( ( ( struct sockaddr_in * ) &local )->sin_port );
+        break;
+    case AF_INET6:
+        memcpy ( &key->remote_ip, ( ( struct sockaddr_in6 * ) &remote )->sin6_addr.s6_addr + 12,
+            4 );
+        key->remote_port = ( ( struct sockaddr_in6 * ) &remote )->sin6_port;
+        key->local_port = ntohs ( ( ( struct sockaddr_in6 * ) &local )->sin6_port );
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Update socket map entry
+ */
+static int sockmap_update ( struct proxy_t *proxy, const struct sockmap_key_t *key, int sock )
+{
+    uint32_t value = sock;
+    union bpf_attr attr;
+
+    memset ( &attr, '\0', sizeof ( attr ) );
+    attr.map_fd = proxy->sockmap_fd;
+    attr.key = ( uint64_t ) ( uintptr_t ) key;
+    attr.value = ( uint64_t ) ( uintptr_t ) & value;
+    attr.flags = BPF_NOEXIST;
+
+    return sockmap_bpf ( BPF_MAP_UPDATE_ELEM, &attr );
+}
+
+/**
+ * Delete socket map entry
+ */
+static void sockmap_delete ( struct proxy_t *proxy, const struct sockmap_key_t *key )
+{
+    union bpf_attr attr;
+
+    memset ( &attr, '\0', sizeof ( attr ) );
+    attr.map_fd = proxy->sockmap_fd;
+    attr.key = ( uint64_t ) ( uintptr_t ) key;
+
+    sockmap_bpf ( BPF_MAP_DELETE_ELEM, &attr );
+}
+
+/**
+ * Check if neither socket of relation has input queued
+ */
+static int sockmap_quiescent ( const struct stream_t *stream )
+{
+    int stream_len;
+    int neighbour_len;
+
+    if ( ioctl ( stream->fd, FIONREAD, &stream_len ) < 0
+        || ioctl ( stream->neighbour->fd, FIONREAD, &neighbour_len ) < 0 )
+    {
+        return 0;
+    }
+
+    return !stream_len && !neighbour_len;
+}
+
+/**
+ * Let kernel redirect relation payload
+ */
+static int sockmap_insert ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int attempts;
+    struct stream_t *neighbour = stream->neighbour;
+    struct sockmap_key_t stream_key;
+    struct sockmap_key_t neighbour_key;
+
+    /* Give up after too many attempts */
+    if ( stream->sockmap <= -SOCKMAP_ATTEMPTS )
+    {
+        return -1;
+    }
+
+    attempts = stream->sockmap - 1;
+
+    /* Queued input would be overtaken by redirected data */
+    if ( !sockmap_quiescent ( stream ) )
+    {
+        stream->sockmap = attempts;
+        neighbour->sockmap = attempts;
+        return -1;
+    }
+
+    stream->sockmap = -SOCKMAP_ATTEMPTS;
+    neighbour->sockmap = -SOCKMAP_ATTEMPTS;
+
+    if ( sockmap_build_key ( stream->fd, &stream_key ) < 0
+        || sockmap_build_key ( neighbour->fd, &neighbour_key ) < 0 )
+    {
+        failure ( "cannot build sockmap key (%i) for socket:%i\n", errno, stream->fd );
+        return -1;
+    }
+
+    /* Each socket key points to its neighbour */
+    if ( sockmap_update ( proxy, &stream_key, neighbour->fd ) < 0 )
+    {
+        verbose ( "cannot insert socket:%i into sockmap (%i)\n", neighbour->fd, errno );
+        return -1;
+    }
+
+    if ( sockmap_update ( proxy, &neighbour_key, stream->fd ) < 0 )
+    {
+        verbose ( "cannot insert socket:%i into sockmap (%i)\n", stream->fd, errno );
+        sockmap_delete ( proxy, &stream_key );
+        return -1;
+    }
+
+    /* Input queued before both entries were in place stays with userspace */
+    if ( !sockmap_quiescent ( stream ) )
+    {
+        verbose ( "input raced sockmap insert of socket:%i, backing out\n", stream->fd );
+        sockmap_delete ( proxy, &stream_key );
+        sockmap_delete ( proxy, &neighbour_key );
+        stream->sockmap = attempts;
+        neighbour->sockmap = attempts;
+        return -1;
+    }
+
+    stream->sockmap = 1;
+    neighbour->sockmap = 1;
+
+    verbose ( "kernel splices socket:%i and socket:%i\n", stream->fd, neighbour->fd );
+
+    return 0;
+}
+
+/**
+ * Close relation spliced in kernel once either side hangs up
+ */
+static int sockmap_intercept ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    UNUSED ( proxy );
+
+    if ( stream->sockmap <= 0 )
+    {
+        return 0;
+    }
+
+    return ( stream->revents & ( POLLRDHUP | POLLHUP | POLLERR ) ) ? -1 : 1;
+}
+
+/**
+ * Watch only closure while kernel owns the payload
+ */
+static void sockmap_events ( struct stream_t *stream )
+{
+    if ( stream->sockmap > 0 )
+    {
+        stream->events = POLLRDHUP;
+    }
+}
+
+/**
+ * Hand relation over to kernel once nothing is in flight
+ */
+static void sockmap_settle ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->sockmap <= 0 )
+    {
+        sockmap_insert ( proxy, stream );
+    }
+}
+
+static const struct forward_ops_t sockmap_ops;
+
+/**
+ * Forward relation through rings until it can be spliced in kernel
+ */
+static int sockmap_relation_setup ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    UNUSED ( proxy );
+
+    stream->forward_ops = &sockmap_ops;
+    stream->neighbour->forward_ops = &sockmap_ops;
+
+    return 0;
+}
+
+static const struct forward_ops_t sockmap_ops = {
+    .setup = sockmap_relation_setup,
+    .events = sockmap_events,
+    .intercept = sockmap_intercept,
+    .settle = sockmap_settle
+};
+
+/* NOTE: Forwarding Mode Related Functions */
+
+/**
+ * Select forwarding operations for preferred mode
+ */
+void forward_ops_init ( struct proxy_t *proxy )
+{
+    proxy->forward_ops = NULL;
+    proxy->sockmap_fd = -1;
+    proxy->sockmap_parser_fd = -1;
+    proxy->sockmap_verdict_fd = -1;
+
+    /* Kernel splicing needs socket map, copy is the fallback */
+    if ( proxy->forward_mode == FORWARD_SOCKMAP && sockmap_setup ( proxy ) < 0 )
+    {
+        info ( "sockmap not available, using copy forwarding\n" );
+        proxy->forward_mode = FORWARD_COPY;
+    }
+
+    if ( proxy->forward_mode == FORWARD_SPLICE )
+    {
+        proxy->forward_ops = &splice_ops;
+
+    } else if ( proxy->forward_mode == FORWARD_ZEROCOPY )
+    {
+        proxy->forward_ops = &zerocopy_ops;
+
+    } else if ( proxy->forward_mode == FORWARD_SOCKMAP )
+    {
+        proxy->forward_ops = &sockmap_ops;
+    }
+}
+
+/**
+ * Release forwarding mode resources
+ */
+void forward_ops_free ( struct proxy_t *proxy )
+{
+    sockmap_free ( proxy );
+    proxy->forward_ops = NULL;
+}
+
+/**
+ * Track forwarding mode resources across stream lifetime
+ */
+void forward_stream_state ( struct proxy_t *proxy, struct stream_t *stream, int prev )
+{
+    if ( prev < 0 && stream->state >= 0 )
+    {
+        stream->pipefd[0] = -1;
+        stream->pipefd[1] = -1;
+
+    } else if ( stream->state < 0 )
+    {
+        stream_pipe_close ( proxy, stream );
+        stream->forward_ops = NULL;
+    }
+}
@@ -6,77 +6,907 @@
 #include <linux/netfilter_ipv4.h>
 
 /**
- * Estabilish connection with endpoint
+ * Build socks CONNECT request for the relation destination
+ */
+static int build_socks_request ( struct proxy_t *proxy, struct stream_t *stream, uint8_t *arr )
+{
+    struct sockaddr_storage saddr;
+    struct sockaddr_in *saddr_in;
+    struct sockaddr_in6 *saddr_in6;
+    char straddr[STRADDR_SIZE];
+
+    /* Get destiantion host and port */
+    if ( stream->neighbour->cold->dest_known )
+    {
+        memcpy ( &saddr, &stream->neighbour->cold->dest, sizeof ( struct sockaddr_storage ) );
+
+    } else if ( get_original_dest ( stream->neighbour->fd, &saddr ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( proxy->verbose )
+    {
+        format_ip_port ( &saddr, straddr, sizeof ( straddr ) );
+    }
+
+    verbose ( "will connect (%s) via socks proxy with socket:%i...\n", straddr, stream->fd );
+
+    switch ( saddr.ss_family )
+    {
+    case AF_INET:
+        saddr_in = ( struct sockaddr_in * ) &saddr;
+        /* Prepare request */
+        arr[0] = 5;     /* SOCKS5 version */
+        arr[1] = 1;     /* TCP/IP stream */
+        arr[2] = 0;     /* Reserved */
+        arr[3] = 1;     /* Connect IPv4 */
+        memcpy ( arr + 4, &saddr_in->sin_addr, 4 );     /* IP 1st - 4th byte */
+        arr[8] = ntohs ( saddr_in->sin_port ) >> 8;     /* Port 1st byte */
+        arr[9] = ntohs ( saddr_in->sin_port ) & 0xff;   /* Port 2nd byte */
+        return 10;
+    case AF_INET6:
+        saddr_in6 = ( struct sockaddr_in6 * ) &saddr;
+        /* Prepare request */
+        arr[0] = 5;     /* SOCKS5 version */
+        arr[1] = 1;     /* TCP/IP stream */
+        arr[2] = 0;     /* Reserved */
+        arr[3] = 4;     /* Connect IPv6 */
+        memcpy ( arr + 4, &saddr_in6->sin6_addr, 16 );  /* IP 1st - 16th byte */
+        arr[20] = ntohs ( saddr_in6->sin6_port ) >> 8;  /* Port 1st byte */
+        arr[21] = ntohs ( saddr_in6->sin6_port ) & 0xff;        /* Port 2nd byte */
+        return 22;
+    default:
+        failure ( "invalid socket family (%i) on socket:%i\n", saddr.ss_family, stream->fd );
+        return -1;
+    }
+}
+
+/**
+ * Start buffering client bytes sent ahead of the socks reply
+ */
+static int watch_early_data ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( !proxy->early_data )
+    {
+        return 0;
+    }
+
+    /* Forwarding ring takes the bytes, carried on once the reply is in */
+    if ( ring_alloc ( &stream->ring, proxy->chunk_len ) < 0 )
+    {
+        failure ( "cannot allocate ring buffer for socket:%i\n", stream->fd );
+        return -1;
+    }
+
+    stream->events = POLLIN;
+    stream_mark_dirty ( proxy, stream );
+
+    return 0;
+}
+
+/**
+ * Buffer client bytes arriving before the socks request went out
+ */
+static int handle_early_data ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    ssize_t len;
+
+    /* Hangup or error before forwarding ends the relation */
+    if ( ~stream->revents & POLLIN || !stream->ring.arr )
+    {
+        return -1;
+    }
+
+    if ( ( len = socket_recv_ring ( stream->fd, &stream->ring ) ) < 0 )
+    {
+        if ( errno == EAGAIN )
+        {
+            return 0;
+        }
+
+        failure ( "cannot receive data (%i) from socket:%i\n", errno, stream->fd );
+        return -1;
+    }
+
+    /* Client close is seen again once forwarding starts */
+    if ( !len || stream->ring.len >= stream->ring.size )
+    {
+        stream->events = 0;
+    }
+
+    if ( len > 0 )
+    {
+        verbose ( "buffered %i byte(s) of early data from socket:%i\n", ( int ) len, stream->fd );
+    }
+
+    return 0;
+}
+
+/**
+ * Check if queued handshake bytes end with the socks request
+ */
+static int request_queued ( struct proxy_t *proxy, const struct stream_t *stream )
+{
+    return stream->neighbour && ( stream->level == LEVEL_SOCKS_REQ
+        || ( stream->level == LEVEL_SOCKS_VER && proxy->pipelined ) );
+}
+
+/**
+ * Send queued handshake bytes, client early data rides behind the request
+ */
+static int send_handshake_queue ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    size_t len;
+    ssize_t sent;
+    struct msghdr msg;
+    struct iovec iov[3];
+    struct queue_t *queue = &stream->cold->queue;
+    struct ring_t *ring = NULL;
+
+    if ( proxy->early_data && request_queued ( proxy, stream ) )
+    {
+        ring = &stream->neighbour->ring;
+    }
+
+    memset ( &msg, '\0', sizeof ( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+
+    iov[0].iov_base = queue->arr;
+    iov[0].iov_len = queue->len;
+
+    /* Buffered data may wrap around ring end */
+    if ( ring && ring->len )
+    {
+        iov[1].iov_base = ring->arr + ring->off;
+        iov[1].iov_len = ring->len;
+        msg.msg_iovlen = 2;
+
+        if ( ring->off + ring->len > ring->size )
+        {
+            iov[1].iov_len = ring->size - ring->off;
+            iov[2].iov_base = ring->arr;
+            iov[2].iov_len = ring->len - iov[1].iov_len;
+            msg.msg_iovlen = 3;
+        }
+    }
+
+    if ( ( sent = sendmsg ( stream->fd, &msg, MSG_NOSIGNAL ) ) < 0 )
+    {
+        /* Fast open without cookie sends plain SYN, data goes after handshake */
+        return errno == EAGAIN || errno == EINPROGRESS ? 0 : -1;
+    }
+
+    /* Request goes out first, early data behind it */
+    len = ( size_t ) sent < queue->len ? ( size_t ) sent : queue->len;
+    queue_drop ( queue, len );
+    sent -= len;
+
+    if ( sent > 0 )
+    {
+        verbose ( "sent %i byte(s) of early data from socket:%i with request\n", ( int ) sent,
+            stream->neighbour->fd );
+        ring->off = ( ring->off + sent ) % ring->size;
+        ring->len -= sent;
+
+        if ( !ring->len )
+        {
+            ring->off = 0;
+        }
+    }
+
+    /* Bytes arriving later wait for forwarding */
+    if ( ring && !queue->len && stream->neighbour->events )
+    {
+        stream->neighbour->events = 0;
+        stream_mark_dirty ( proxy, stream->neighbour );
+    }
+
+    return 0;
+}
+
+/**
+ * Queue socks CONNECT request and wait for its reply
+ */
+static int send_socks_request ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    uint8_t arr[SOCKS_REQUEST_LEN_MAX];
+
+    /* Print current stage */
+    verbose ( "processing socks CLIENT/REQUEST stage on socket:%i...\n", stream->fd );
+
+    if ( ( len = build_socks_request ( proxy, stream, arr ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Enqueue request */
+    if ( queue_set ( &stream->cold->queue, arr, len ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Update levels and events flags */
+    stream_set_stage ( proxy, stream, LEVEL_SOCKS_REQ, proxy->request_timeout, TIMEOUT_REQUEST );
+    stream->events = POLLOUT;
+
+    return 0;
+}
+
+/* NOTE: Upstream Related Functions */
+
+/**
+ * Choose upstream socks server for a new relation
+ */
+static int pick_upstream ( struct proxy_t *proxy )
+{
+    size_t i;
+    size_t index;
+    size_t start;
+    size_t best;
+    size_t retry;
+    uint64_t cost;
+    uint64_t best_cost = UINT64_MAX;
+    uint64_t retry_at = UINT64_MAX;
+    const struct upstream_t *upstream;
+
+    /* Rotating start spreads ties over all upstreams */
+    start = proxy->upstream_next++ % proxy->upstream_count;
+    best = start;
+    retry = start;
+
+    for ( i = 0; i < proxy->upstream_count; i++ )
+    {
+        index = ( start + i ) % proxy->upstream_count;
+        upstream = &proxy->upstreams[index];
+
+        /* Failing upstream is skipped until its back-off passes */
+        if ( upstream->retry_at > proxy->now )
+        {
+            if ( upstream->retry_at < retry_at )
+            {
+                retry_at = upstream->retry_at;
+                retry = index;
+            }
+            continue;
+        }
+
+        if ( proxy->balance == BALANCE_RR )
+        {
+            return index;
+        }
+
+        cost = upstream->active + 1;
+
+        /* Slow upstream needs proportionally fewer relations to lose */
+        if ( proxy->balance == BALANCE_EWMA )
+        {
+            cost *= upstream->latency + 1;
+        }
+
+        if ( cost < best_cost )
+        {
+            best_cost = cost;
+            best = index;
+        }
+    }
+
+    /* All upstreams are failing, probe the one to recover first */
+    return best_cost == UINT64_MAX ? retry : best;
+}
+
+/**
+ * Get back-off window of failing upstream
+ */
+static uint64_t upstream_backoff ( const struct upstream_t *upstream )
+{
+    uint64_t window = UPSTREAM_BACKOFF_MSEC;
+    size_t i;
+
+    for ( i = 1; i < upstream->failures && window < UPSTREAM_BACKOFF_MAX_MSEC; i++ )
+    {
+        window *= 2;
+    }
+
+    return window < UPSTREAM_BACKOFF_MAX_MSEC ? window : UPSTREAM_BACKOFF_MAX_MSEC;
+}
+
+/**
+ * Record upstream failure and back off from it
+ */
+static void fail_upstream ( struct proxy_t *proxy, int index )
+{
+    struct upstream_t *upstream = &proxy->upstreams[index];
+
+    upstream->failures++;
+    upstream->failed++;
+    upstream->retry_at = proxy->now + upstream_backoff ( upstream );
+
+    verbose ( "upstream #%i failed %i time(s) in a row, backing off\n", index,
+        ( int ) upstream->failures );
+}
+
+/**
+ * Charge failed relation handshake to its upstream
+ */
+void fail_upstream_handshake ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    /* Client side charges the upstream it waits for */
+    if ( stream->role == S_PORT_A )
+    {
+        stream = stream->neighbour;
+    }
+
+    if ( stream && stream->cold->bound && stream->state == STREAM_HANDSHAKE )
+    {
+        fail_upstream ( proxy, stream->cold->upstream );
+    }
+}
+
+/**
+ * Connect upstream socks server chosen by the policy
+ */
+static int connect_upstream ( struct proxy_t *proxy, int *index )
+{
+    int sock;
+    struct upstream_t *upstream;
+
+    *index = pick_upstream ( proxy );
+    upstream = &proxy->upstreams[*index];
+
+    /* Recovering upstream gets a single probe per back-off window */
+    if ( upstream->failures )
+    {
+        upstream->retry_at = proxy->now + upstream_backoff ( upstream );
+    }
+
+    if ( ( sock = connect_async ( proxy, &upstream->saddr ) ) < 0 )
+    {
+        fail_upstream ( proxy, *index );
+        return sock;
+    }
+
+    upstream->relations++;
+
+    return sock;
+}
+
+/**
+ * Count stream in upstream active relations
+ */
+static void bind_upstream ( struct proxy_t *proxy, struct stream_t *stream, int index )
+{
+    stream->cold->upstream = index;
+    stream->cold->upstream_stamp = get_monotonic_usec (  );
+    stream->cold->bound = 1;
+    proxy->upstreams[index].active++;
+}
+
+/**
+ * Stop counting stream in upstream active relations
+ */
+static void unbind_upstream ( struct proxy_t *proxy, struct stream_t *stream, int prev )
+{
+    if ( !stream->cold->bound )
+    {
+        return;
+    }
+
+    /* Refused or reset connect is reported as socket error */
+    if ( prev == STREAM_HANDSHAKE && stream->level == LEVEL_CONNECTING && stream->fd >= 0
+        && socket_has_error ( stream->fd ) )
+    {
+        fail_upstream ( proxy, stream->cold->upstream );
+    }
+
+    proxy->upstreams[stream->cold->upstream].active--;
+    stream->cold->bound = 0;
+}
+
+/**
+ * Feed completed handshake time into upstream latency average
+ */
+static void complete_upstream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    uint64_t sample;
+    struct upstream_t *upstream = &proxy->upstreams[stream->cold->upstream];
+
+    sample = get_monotonic_usec (  ) - stream->cold->upstream_stamp;
+    upstream->latency = upstream->handshakes ? ( upstream->latency * 7 + sample ) / 8 : sample;
+    upstream->handshakes++;
+    upstream->failures = 0;
+    upstream->retry_at = 0;
+}
+
+/**
+ * Show per upstream statistics
+ */
+static void show_upstream_stats ( struct proxy_t *proxy )
+{
+    size_t i;
+    const struct upstream_t *upstream;
+
+    if ( proxy->upstream_count < 2 )
+    {
+        return;
+    }
+
+    for ( i = 0; i < proxy->upstream_count; i++ )
+    {
+        upstream = &proxy->upstreams[i];
+        info ( "upstream #%i: active:%i total:%i done:%i failed:%i latency:%ius\n", ( int ) i,
+            ( int ) upstream->active, ( int ) upstream->relations, ( int ) upstream->handshakes,
+            ( int ) upstream->failed, ( int ) upstream->latency );
+    }
+}
+
+/* NOTE: Warm Pool Related Functions */
+
+/**
+ * Connect and greet a spare upstream stream
  */
-static int setup_endpoint_stream ( struct proxy_t *proxy, struct stream_t *stream,
-    const struct sockaddr_storage *saddr )
+static int open_warm_stream ( struct proxy_t *proxy )
 {
     int sock;
+    int index;
+    struct stream_t *stream;
+
+    if ( ( sock = connect_upstream ( proxy, &index ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Spare streams never push out live relations */
+    if ( !( stream = insert_stream ( proxy, sock ) ) )
+    {
+        shutdown_then_close ( proxy, sock );
+        return -1;
+    }
+
+    stream->role = S_PORT_W;
+    stream->events = POLLIN | POLLOUT;
+    bind_upstream ( proxy, stream, index );
+    stream_set_state ( proxy, stream, STREAM_HANDSHAKE );
+    stream_set_stage ( proxy, stream, LEVEL_CONNECTING, proxy->connect_timeout, TIMEOUT_CONNECT );
+
+    verbose ( "warming up upstream socket:%i\n", sock );
+
+    return 0;
+}
+
+/**
+ * Park greeted upstream stream until a client takes it
+ */
+static void park_warm_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    /* Spare does not load its upstream until claimed */
+    proxy->upstreams[stream->cold->upstream].active--;
+    stream->cold->bound = 0;
+
+    /* Keep connect and greeting time, CONNECT exchange adds up later */
+    stream->cold->upstream_stamp = get_monotonic_usec (  ) - stream->cold->upstream_stamp;
+
+    stream_queue_release ( proxy, stream );
+    stream_set_state ( proxy, stream, STREAM_PARKED );
+    stream_set_stage ( proxy, stream, LEVEL_WARM, proxy->warm_ttl, TIMEOUT_STALE );
+
+    /* Anything readable now means the server went away */
+    stream->events = POLLIN;
+
+    verbose ( "parked warm upstream socket:%i\n", stream->fd );
+}
+
+/**
+ * Pair new client stream with a parked upstream stream
+ */
+static int claim_warm_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
     struct stream_t *neighbour;
 
-    /* Connect remote endpoint asynchronously */
-    if ( ( sock = connect_async ( proxy, saddr ) ) < 0 )
+    if ( !( neighbour = proxy->state_head[STREAM_PARKED] ) )
+    {
+        return -1;
+    }
+
+    if ( stream_queue_acquire ( proxy, neighbour ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Relation starts now, not when upstream was warmed up */
+    neighbour->role = S_PORT_B;
+    neighbour->cold->created = proxy->now;
+    neighbour->cold->bound = 1;
+    proxy->upstreams[neighbour->cold->upstream].active++;
+
+    /* Latency sample spans whole handshake as for cold relations */
+    neighbour->cold->upstream_stamp = get_monotonic_usec (  ) - neighbour->cold->upstream_stamp;
+    neighbour->neighbour = stream;
+    stream->neighbour = neighbour;
+    stream_set_state ( proxy, neighbour, STREAM_HANDSHAKE );
+
+    verbose ( "new relation between socket:%i and warm socket:%i\n", stream->fd,
+        neighbour->fd );
+
+    /* Only the CONNECT exchange is left */
+    if ( send_socks_request ( proxy, neighbour ) < 0 )
+    {
+        remove_relation ( proxy, stream );
+        return -2;
+    }
+
+    stream_mark_dirty ( proxy, neighbour );
+
+    return 0;
+}
+
+/**
+ * Keep warm pool sized to the recent accept rate
+ */
+static void refill_warm_pool ( struct proxy_t *proxy )
+{
+    size_t have;
+    size_t target;
+    uint64_t elapsed = proxy->now - proxy->warm_stamp;
+
+    /* Smooth accepts per second over periods */
+    if ( elapsed >= WARM_PERIOD_MSEC )
+    {
+        proxy->warm_rate = ( proxy->warm_rate * 3 + proxy->warm_accepts * 1000 / elapsed ) / 4;
+        proxy->warm_accepts = 0;
+        proxy->warm_opened = 0;
+        proxy->warm_stamp = proxy->now;
+    }
+
+    /* Cover accepts expected within the window, at least one */
+    target = ( proxy->warm_rate * WARM_WINDOW_MSEC + 999 ) / 1000;
+
+    if ( target > proxy->warm_max )
+    {
+        target = proxy->warm_max;
+    }
+
+    if ( !target )
+    {
+        target = 1;
+    }
+
+    /* Streams being warmed up count in as well */
+    have = proxy->state_count[STREAM_PARKED]
+        + proxy->role_count[STREAM_HANDSHAKE][STREAM_ROLE_OTHER];
+
+    /* Failing upstream must not be retried in a busy loop */
+    for ( ; have < target && proxy->warm_opened < target + proxy->warm_accepts; have++ )
+    {
+        if ( open_warm_stream ( proxy ) < 0 )
+        {
+            break;
+        }
+
+        proxy->warm_opened++;
+    }
+}
+
+/**
+ * Attach connecting endpoint socket to the stream
+ */
+static int attach_endpoint_stream ( struct proxy_t *proxy, struct stream_t *stream, int sock,
+    int upstream )
+{
+    struct stream_t *neighbour;
+
+    /* Try allocating neighbour stream */
+    if ( !( neighbour = insert_stream ( proxy, sock ) ) )
+    {
+        force_cleanup ( proxy, stream );
+        neighbour = insert_stream ( proxy, sock );
+    }
+
+    /* Check for neighbour stream */
+    if ( !neighbour )
+    {
+        shutdown_then_close ( proxy, sock );
+        return -2;
+    }
+
+    /* Set neighbour role */
+    neighbour->role = S_PORT_B;
+    neighbour->events = POLLIN | POLLOUT;
+    bind_upstream ( proxy, neighbour, upstream );
+    stream_set_state ( proxy, neighbour, STREAM_HANDSHAKE );
+    stream_set_stage ( proxy, neighbour, LEVEL_CONNECTING, proxy->connect_timeout,
+        TIMEOUT_CONNECT );
+
+    /* Build up a new relation */
+    neighbour->neighbour = stream;
+    stream->neighbour = neighbour;
+
+    verbose ( "new relation between socket:%i and socket:%i\n", stream->fd, sock );
+
+    return 0;
+}
+
+/**
+ * Estabilish connection with endpoint
+ */
+static int setup_endpoint_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int sock;
+    int upstream;
+
+    /* Connect remote endpoint asynchronously */
+    if ( ( sock = connect_upstream ( proxy, &upstream ) ) < 0 )
+    {
+        return sock;
+    }
+
+    return attach_endpoint_stream ( proxy, stream, sock, upstream );
+}
+
+/**
+ * Handle new stream creation
+ */
+static int handle_new_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int status;
+    struct stream_t *util;
+
+    if ( ~stream->revents & POLLIN )
+    {
+        return -1;
+    }
+
+    /* Accept incoming connection */
+    if ( !( util = accept_new_stream ( proxy, stream->fd ) ) )
+    {
+        return -2;
+    }
+
+    /* Setup new stream */
+    util->role = S_PORT_A;
+    util->level = LEVEL_AWAITING;
+    util->events = 0;
+    stream_set_state ( proxy, util, STREAM_HANDSHAKE );
+    proxy->warm_accepts++;
+
+    /* Client may speak first, its bytes ride with the request */
+    if ( watch_early_data ( proxy, util ) < 0 )
+    {
+        remove_stream ( proxy, util );
+        return 0;
+    }
+
+    /* Prefer upstream that is already greeted */
+    if ( proxy->warm_max && ( status = claim_warm_stream ( proxy, util ) ) != -1 )
+    {
+        return 0;
+    }
+
+    /* Setup endpoint stream */
+    if ( ( status = setup_endpoint_stream ( proxy, util ) ) < 0 )
+    {
+        remove_stream ( proxy, util );
+        return status;
+    }
+
+    return 0;
+}
+
+/**
+ * Adopt relation handed off by another thread
+ */
+static void adopt_relation ( struct proxy_t *proxy, const struct handoff_t *item )
+{
+    struct stream_t *util;
+
+    /* Try allocating new stream */
+    if ( !( util = insert_stream ( proxy, item->a_fd ) ) )
+    {
+        verbose ( "stream pool is full, need to force cleanup...\n" );
+        force_cleanup ( proxy, NULL );
+        util = insert_stream ( proxy, item->a_fd );
+    }
+
+    if ( !util )
+    {
+        shutdown_then_close ( proxy, item->a_fd );
+
+        if ( item->b_fd >= 0 )
+        {
+            shutdown_then_close ( proxy, item->b_fd );
+        }
+
+        return;
+    }
+
+    /* Setup new stream, destination is already known */
+    util->role = S_PORT_A;
+    util->level = LEVEL_AWAITING;
+    util->events = 0;
+    memcpy ( &util->cold->dest, &item->dest, sizeof ( struct sockaddr_storage ) );
+    util->cold->dest_known = 1;
+    stream_set_state ( proxy, util, STREAM_HANDSHAKE );
+
+    /* Accepted relation gets its upstream connected from this worker */
+    if ( item->kind == HANDOFF_ACCEPTED )
+    {
+        proxy->warm_accepts++;
+
+        if ( watch_early_data ( proxy, util ) < 0 )
+        {
+            remove_stream ( proxy, util );
+            return;
+        }
+
+        if ( proxy->warm_max && claim_warm_stream ( proxy, util ) != -1 )
+        {
+            return;
+        }
+
+        if ( setup_endpoint_stream ( proxy, util ) < 0 )
+        {
+            remove_stream ( proxy, util );
+        }
+
+        return;
+    }
+
+    /* Migrated relation keeps its upstream socket and counts */
+    if ( attach_endpoint_stream ( proxy, util, item->b_fd, item->upstream ) < 0 )
+    {
+        remove_stream ( proxy, util );
+        return;
+    }
+
+    /* Migrated relation has finished handshake already */
+    if ( setup_forwarding ( proxy, util ) < 0 )
+    {
+        remove_relation ( proxy, util );
+    }
+}
+
+/**
+ * Check if relation can move to another worker right now
+ */
+static int relation_can_migrate ( const struct stream_t *stream )
+{
+    const struct stream_t *neighbour = stream->neighbour;
+
+    /* Nothing may be buffered or in flight on either side, zerocopy
+       completion counters live in the stream and cannot move */
+    return stream->role == S_PORT_A && neighbour && !stream->abandoned
+        && !neighbour->abandoned && stream->level == LEVEL_FORWARDING
+        && !stream->eof && !neighbour->eof
+        && !stream_pending_data ( stream ) && !stream_pending_data ( neighbour )
+        && !stream->ring.held && !neighbour->ring.held
+        && stream->sockmap <= 0 && neighbour->sockmap <= 0
+        && !stream->zerocopy && !neighbour->zerocopy;
+}
+
+/**
+ * Detach stream from this worker, keeping its socket open
+ */
+static int detach_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int sock = stream->fd;
+
+    if ( stream->pollref == EPOLLREF )
     {
-        return sock;
+        epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_DEL, sock, NULL );
+        stream->pollref = NULL;
     }
 
-    /* Try allocating neighbour stream */
-    if ( !( neighbour = insert_stream ( proxy, sock ) ) )
+    stream->fd = -1;
+    remove_stream ( proxy, stream );
+
+    return sock;
+}
+
+/**
+ * Move busy relations to the worker picked by the rebalancer
+ */
+static void migrate_relations ( struct proxy_t *proxy )
+{
+    int i;
+    size_t rate;
+    size_t best_rate;
+    size_t shed;
+    uint64_t now;
+    uint64_t elapsed;
+    struct stream_t *iter;
+    struct stream_t *best;
+    struct handoff_queue_t *target;
+    struct handoff_t item;
+
+    if ( !( target = __atomic_exchange_n ( &proxy->migrate_target, NULL, __ATOMIC_ACQUIRE ) ) )
     {
-        force_cleanup ( proxy, stream );
-        neighbour = insert_stream ( proxy, sock );
+        return;
     }
 
-    /* Check for neighbour stream */
-    if ( !neighbour )
+    shed = __atomic_load_n ( &proxy->migrate_rate, __ATOMIC_RELAXED );
+    now = get_monotonic_msec (  );
+    elapsed = now > proxy->rate_stamp ? now - proxy->rate_stamp : 1;
+
+    /* Pending io_uring polls still reference the sockets */
+    if ( proxy->uring.fd < 0 )
     {
-        shutdown_then_close ( proxy, sock );
-        return -2;
-    }
+        for ( i = 0; i < REBALANCE_BATCH && shed; i++ )
+        {
+            best = NULL;
+            best_rate = 0;
 
-    /* Set neighbour role */
-    neighbour->role = S_PORT_B;
-    neighbour->level = LEVEL_CONNECTING;
-    neighbour->events = POLLIN | POLLOUT;
+            /* Heaviest relation not above the rate left to shed */
+            for ( iter = proxy->state_head[STREAM_FORWARDING]; iter; iter = iter->state_next )
+            {
+                rate = ( iter->forwarded + ( iter->neighbour ? iter->neighbour->forwarded : 0 ) )
+                    * 1000 / elapsed;
+
+                if ( rate > best_rate && rate <= shed && relation_can_migrate ( iter ) )
+                {
+                    best = iter;
+                    best_rate = rate;
+                }
+            }
 
-    /* Build up a new relation */
-    neighbour->neighbour = stream;
-    stream->neighbour = neighbour;
+            if ( !best )
+            {
+                break;
+            }
 
-    verbose ( "new relation between socket:%i and socket:%i\n", stream->fd, sock );
+            item.kind = HANDOFF_MIGRATED;
+            item.upstream = best->neighbour->cold->upstream;
+            memcpy ( &item.dest, &best->cold->dest, sizeof ( struct sockaddr_storage ) );
+            item.b_fd = detach_stream ( proxy, best->neighbour );
+            item.a_fd = detach_stream ( proxy, best );
+            shed -= best_rate;
 
-    return 0;
+            verbose ( "migrating relation of socket:%i and socket:%i (%i B/s)\n", item.a_fd,
+                item.b_fd, ( int ) best_rate );
+
+            /* Keep the relation here if target cannot take it */
+            if ( handoff_push ( target, &item ) < 0 )
+            {
+                adopt_relation ( proxy, &item );
+                break;
+            }
+        }
+    }
+
+    /* Start a new sampling period */
+    for ( iter = proxy->state_head[STREAM_FORWARDING]; iter; iter = iter->state_next )
+    {
+        iter->forwarded = 0;
+    }
+
+    proxy->rate_stamp = now;
 }
 
 /**
- * Handle new stream creation
+ * Handle relations handed off by the acceptor
  */
-static int handle_new_stream ( struct proxy_t *proxy, struct stream_t *stream )
+static int handle_handoff ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    int status;
-    struct stream_t *util;
+    uint64_t value;
+    struct handoff_t item;
 
     if ( ~stream->revents & POLLIN )
     {
         return -1;
     }
 
-    /* Accept incoming connection */
-    if ( !( util = accept_new_stream ( proxy, stream->fd ) ) )
+    /* Reset wakeup counter before draining so no wakeup is lost */
+    if ( read ( stream->fd, &value, sizeof ( value ) ) < 0 && errno != EAGAIN )
     {
-        return -2;
+        failure ( "cannot read hand-off event (%i)\n", errno );
+        return -1;
     }
 
-    /* Setup new stream */
-    util->role = S_PORT_A;
-    util->level = LEVEL_AWAITING;
-    util->events = 0;
-
-    /* Setup endpoint stream */
-    if ( ( status = setup_endpoint_stream ( proxy, util, &proxy->socks5 ) ) < 0 )
+    while ( handoff_pop ( proxy->handoff, &item ) >= 0 )
     {
-        remove_stream ( proxy, util );
-        return status;
+        verbose ( "adopting relation of socket:%i and socket:%i\n", item.a_fd, item.b_fd );
+        adopt_relation ( proxy, &item );
     }
 
     return 0;
@@ -85,7 +915,7 @@ static int handle_new_stream ( struct proxy_t *proxy, struct stream_t *stream )
 /**
  * Obtain original address and port from iptables redirect
  */
-static int get_original_dest ( int sock, struct sockaddr_storage *saddr )
+int get_original_dest ( int sock, struct sockaddr_storage *saddr )
 {
     socklen_t addrlen = sizeof ( struct sockaddr_storage );
 
@@ -103,36 +933,90 @@ static int get_original_dest ( int sock, struct sockaddr_storage *saddr )
 }
 
 /**
- * Handle stream socks handshake and request
+ * Get socks CONNECT reply length, zero if not complete yet
  */
-static int handle_stream_socks ( struct proxy_t *proxy, struct stream_t *stream )
+static int socks_reply_len ( struct proxy_t *proxy, struct stream_t *stream )
 {
     size_t len;
-    struct sockaddr_storage saddr;
-    struct sockaddr_in *saddr_in;
-    struct sockaddr_in6 *saddr_in6;
-    char straddr[STRADDR_SIZE];
-    uint8_t arr[DATA_QUEUE_CAPACITY];
+    const struct queue_t *queue = &stream->cold->queue;
+
+    /* Version, status, reserved and address type come first */
+    if ( check_enough_data ( proxy, stream, 4 ) < 0 )
+    {
+        return 0;
+    }
+
+    switch ( queue->arr[3] )
+    {
+    case 1:
+        len = 4 + 4 + 2;
+        break;
+    case 4:
+        len = 4 + 16 + 2;
+        break;
+    case 3:
+        if ( check_enough_data ( proxy, stream, 5 ) < 0 )
+        {
+            return 0;
+        }
+        len = 4 + 1 + queue->arr[4] + 2;
+        break;
+    default:
+        failure ( "invalid socks address type (0x%.2x) on socket:%i\n", queue->arr[3],
+            stream->fd );
+        return -1;
+    }
+
+    /* Bytes past the reply are payload already */
+    if ( check_enough_data ( proxy, stream, len ) < 0 )
+    {
+        return 0;
+    }
+
+    return len;
+}
 
+/**
+ * Handle stream socks handshake and request
+ */
+static int handle_stream_socks ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    ssize_t recvlen;
+    uint8_t arr[3 + SOCKS_REQUEST_LEN_MAX];
+    struct queue_t *queue = &stream->cold->queue;
 
-    /* Expect socket ready to be read */
-    if ( stream->revents & POLLIN )
+    /* Expect socket ready to be read, nothing is read before the greeting */
+    if ( ( stream->revents & POLLIN ) && queue->arr )
     {
-        /* Receive data chunk */
-        if ( ( ssize_t ) ( len = recv ( stream->fd, arr, sizeof ( arr ), 0 ) ) < 2 )
+        /* Reply must fit the handshake queue */
+        if ( queue->len >= queue->capacity )
         {
-            failure ( "cannot receive data (%i) from socket:%i\n", errno, stream->fd );
+            failure ( "socks reply too long on socket:%i\n", stream->fd );
             return -1;
         }
 
-        /* Print progress */
-        verbose ( "received %i byte(s) in handshake from socket:%i\n", ( int ) len, stream->fd );
+        /* Receive data chunk straight into the queue */
+        if ( ( recvlen = recv ( stream->fd, queue->arr + queue->len,
+                    queue->capacity - queue->len, 0 ) ) < 0 && errno == EAGAIN )
+        {
+            return 0;
+        }
 
-        /* Enqueue input data */
-        if ( queue_push ( &stream->queue, arr, len ) < 0 )
+        if ( recvlen <= 0 )
         {
+            failure ( "cannot receive data (%i) from socket:%i\n", recvlen ? errno : 0,
+                stream->fd );
+            fail_upstream_handshake ( proxy, stream );
             return -1;
         }
+
+        /* Print progress */
+        verbose ( "received %i byte(s) in handshake from socket:%i\n", ( int ) recvlen,
+            stream->fd );
+
+        /* Account input data */
+        queue->len += recvlen;
     }
 
     switch ( stream->level )
@@ -147,145 +1031,160 @@ static int handle_stream_socks ( struct proxy_t *proxy, struct stream_t *stream
             arr[0] = 5; /* SOCKS5 version */
             arr[1] = 1; /* One auth method */
             arr[2] = 0; /* No auth method */
+            len = 3;
+
+            /* Send CONNECT right behind the greeting, saving a round trip */
+            if ( proxy->pipelined && stream->neighbour )
+            {
+                verbose ( "processing socks CLIENT/REQUEST stage on socket:%i...\n", stream->fd );
+
+                if ( ( len = build_socks_request ( proxy, stream, arr + 3 ) ) < 0 )
+                {
+                    return -1;
+                }
+
+                len += 3;
+            }
+
+            /* Handshake queue is taken only for the handshake */
+            if ( stream_queue_acquire ( proxy, stream ) < 0 )
+            {
+                return -1;
+            }
 
             /* Enqueue request */
-            if ( queue_set ( &stream->queue, arr, 3 ) < 0 )
+            if ( queue_set ( &stream->cold->queue, arr, len ) < 0 )
             {
                 return -1;
             }
 
             /* Update levels and events flags */
-            stream->level = LEVEL_SOCKS_VER;
+            stream_set_stage ( proxy, stream, LEVEL_SOCKS_VER, proxy->greeting_timeout,
+                TIMEOUT_GREETING );
             stream->events = POLLOUT;
         }
         break;
     case LEVEL_SOCKS_VER:
-        if ( stream->revents & POLLIN )
+        if ( ~stream->revents & POLLIN )
         {
-            /* Print current stage */
-            verbose ( "verifying socks CLIENT/VERSION stage on socket:%i...\n", stream->fd );
+            break;
+        }
 
-            /* Assert minimum data length */
-            if ( check_enough_data ( proxy, stream, 2 ) < 0 )
-            {
-                return 0;
-            }
+        /* Print current stage */
+        verbose ( "verifying socks CLIENT/VERSION stage on socket:%i...\n", stream->fd );
 
-            /* Expect SOCKS5 version */
-            if ( stream->queue.arr[0] != 5 )
-            {
-                failure ( "invalid socks version (0x%.2x) on socket:%i\n", stream->queue.arr[0],
-                    stream->fd );
-                return -1;
-            }
+        /* Assert minimum data length */
+        if ( check_enough_data ( proxy, stream, 2 ) < 0 )
+        {
+            return 0;
+        }
 
-            /* Expect no auth method */
-            if ( stream->queue.arr[1] != 0 )
-            {
-                failure ( "invalid socks auth method (0x%.2x) on socket:%i\n", stream->queue.arr[1],
-                    stream->fd );
-                return -1;
-            }
+        /* Expect SOCKS5 version */
+        if ( stream->cold->queue.arr[0] != 5 )
+        {
+            failure ( "invalid socks version (0x%.2x) on socket:%i\n", stream->cold->queue.arr[0],
+                stream->fd );
+            fail_upstream_handshake ( proxy, stream );
+            return -1;
+        }
 
-            /* Print current stage */
-            verbose ( "completed socks CLIENT/VERSION stage on socket:%i\n", stream->fd );
+        /* Expect no auth method */
+        if ( stream->cold->queue.arr[1] != 0 )
+        {
+            failure ( "invalid socks auth method (0x%.2x) on socket:%i\n",
+                stream->cold->queue.arr[1], stream->fd );
+            fail_upstream_handshake ( proxy, stream );
+            return -1;
+        }
 
-            /* Print current stage */
-            verbose ( "processing socks CLIENT/REQUEST stage on socket:%i...\n", stream->fd );
+        /* Print current stage */
+        verbose ( "completed socks CLIENT/VERSION stage on socket:%i\n", stream->fd );
 
-            /* Get destiantion host and port */
-            if ( get_original_dest ( stream->neighbour->fd, &saddr ) < 0 )
+        /* Greeting went out first, so it tells whether it rode in the SYN */
+        if ( proxy->fastopen )
+        {
+            if ( socket_fastopen_acked ( stream->fd ) > 0 )
             {
-                return -1;
-            }
+                proxy->fastopen_acked++;
 
-            if ( proxy->verbose )
+            } else
             {
-                format_ip_port ( &saddr, straddr, sizeof ( straddr ) );
+                proxy->fastopen_fallback++;
             }
+        }
 
-            verbose ( "will connect (%s) via socks proxy with socket:%i...\n", straddr,
-                stream->fd );
+        /* Reply to the pipelined CONNECT may follow in the same buffer */
+        queue_drop ( &stream->cold->queue, 2 );
 
-            switch ( saddr.ss_family )
-            {
-            case AF_INET:
-                saddr_in = ( struct sockaddr_in * ) &saddr;
-                /* Prepare request */
-                arr[0] = 5;     /* SOCKS5 version */
-                arr[1] = 1;     /* TCP/IP stream */
-                arr[2] = 0;     /* Reserved */
-                arr[3] = 1;     /* Connect IPv4 */
-                memcpy ( arr + 4, &saddr_in->sin_addr, 4 );     /* IP 1st - 4th byte */
-                arr[8] = ntohs ( saddr_in->sin_port ) >> 8;     /* Port 1st byte */
-                arr[9] = ntohs ( saddr_in->sin_port ) & 0xff;   /* Port 2nd byte */
-                len = 10;
-                break;
-            case AF_INET6:
-                saddr_in6 = ( struct sockaddr_in6 * ) &saddr;
-                /* Prepare request */
-                arr[0] = 5;     /* SOCKS5 version */
-                arr[1] = 1;     /* TCP/IP stream */
-                arr[2] = 0;     /* Reserved */
-                arr[3] = 4;     /* Connect IPv6 */
-                memcpy ( arr + 4, &saddr_in6->sin6_addr, 16 );  /* IP 1st - 4th byte */
-                arr[20] = ntohs ( saddr_in6->sin6_port ) >> 8;  /* Port 1st byte */
-                arr[21] = ntohs ( saddr_in6->sin6_port ) & 0xff;        /* Port 2nd byte */
-                len = 22;
-                break;
-            default:
-                failure ( "invalid socket family (%i) on socket:%i\n", saddr.ss_family,
-                    stream->fd );
-                return -1;
-            }
+        /* Greeted spare upstream waits for a client */
+        if ( !stream->neighbour )
+        {
+            park_warm_stream ( proxy, stream );
+            break;
+        }
 
-            /* Enqueue request */
-            if ( queue_set ( &stream->queue, arr, 10 ) < 0 )
+        if ( !proxy->pipelined )
+        {
+            if ( send_socks_request ( proxy, stream ) < 0 )
             {
                 return -1;
             }
-
-            /* Update levels and events flags */
-            stream->level = LEVEL_SOCKS_REQ;
-            stream->events = POLLOUT;
+            break;
         }
-        break;
+
+        /* Update levels and events flags */
+        stream_set_stage ( proxy, stream, LEVEL_SOCKS_REQ, proxy->request_timeout,
+            TIMEOUT_REQUEST );
+        stream->events = POLLIN;
+        /* fall through */
     case LEVEL_SOCKS_REQ:
         if ( stream->revents & POLLIN )
         {
             /* Print current stage */
             verbose ( "verifying socks CLIENT/REQUEST stage on socket:%i...\n", stream->fd );
 
-            /* Assert minimum data length */
-            if ( check_enough_data ( proxy, stream, 2 ) < 0 )
+            /* Assert whole reply is there */
+            if ( ( len = socks_reply_len ( proxy, stream ) ) <= 0 )
             {
-                return 0;
+                return len;
             }
 
             /* Expect SOCKS5 version */
-            if ( stream->queue.arr[0] != 5 )
+            if ( stream->cold->queue.arr[0] != 5 )
             {
-                failure ( "invalid socks version (0x%.2x) on socket:%i\n", stream->queue.arr[0],
+                failure ( "invalid socks version (0x%.2x) on socket:%i\n", stream->cold->queue.arr[0],
                     stream->fd );
+                fail_upstream_handshake ( proxy, stream );
                 return -1;
             }
 
             /* Expect status success */
-            if ( stream->queue.arr[1] != 0 )
+            if ( stream->cold->queue.arr[1] != 0 )
             {
-                failure ( "invalid socks status (0x%.2x) on socket:%i\n", stream->queue.arr[1],
+                failure ( "invalid socks status (0x%.2x) on socket:%i\n", stream->cold->queue.arr[1],
                     stream->fd );
+
+                /* Unreachable or refusing destination is not the upstream's fault */
+                if ( stream->cold->queue.arr[1] < SOCKS_REP_NET_UNREACH
+                    || stream->cold->queue.arr[1] > SOCKS_REP_TTL_EXPIRED )
+                {
+                    fail_upstream_handshake ( proxy, stream );
+                }
                 return -1;
             }
 
             /* Print current stage */
             verbose ( "completed socks CLIENT/REQUEST stage on socket:%i\n", stream->fd );
 
-            /* Update levels and events flags */
-            stream->level = LEVEL_FORWARDING;
-            stream->events = POLLIN;
-            stream->neighbour->level = LEVEL_FORWARDING;
-            stream->neighbour->events = POLLIN;
+            /* Remaining bytes are carried over into forwarding */
+            queue_drop ( &stream->cold->queue, len );
+            complete_upstream ( proxy, stream );
+
+            /* Start forwarding data */
+            if ( setup_forwarding ( proxy, stream ) < 0 )
+            {
+                return -1;
+            }
         }
         break;
     default:
@@ -307,14 +1206,15 @@ int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream )
         return 0;
     }
 
-    if ( stream->role == S_PORT_B && stream->queue.len && ( stream->revents & POLLOUT ) )
+    if ( ( stream->role == S_PORT_B || stream->role == S_PORT_W ) && stream->cold->queue.len
+        && ( stream->revents & POLLOUT ) )
     {
-        if ( queue_shift ( &stream->queue, stream->fd ) < 0 )
+        if ( send_handshake_queue ( proxy, stream ) < 0 )
         {
-            remove_relation ( stream );
+            remove_relation ( proxy, stream );
             return 0;
         }
-        if ( stream->queue.len == 0 )
+        if ( stream->cold->queue.len == 0 )
         {
             stream->events = POLLIN;
         }
@@ -325,11 +1225,39 @@ int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream )
     {
     case L_ACCEPT:
         show_stats ( proxy );
+        show_timer_stats ( proxy );
+        show_upstream_stats ( proxy );
         if ( handle_new_stream ( proxy, stream ) == -2 )
         {
             return -1;
         }
         return 0;
+    case L_STOP:
+        verbose ( "stop requested\n" );
+        proxy->stopped = 1;
+        return -1;
+    case L_HANDOFF:
+        show_stats ( proxy );
+        show_timer_stats ( proxy );
+        show_upstream_stats ( proxy );
+        if ( handle_handoff ( proxy, stream ) < 0 )
+        {
+            return -1;
+        }
+        return 0;
+    case S_PORT_A:
+        if ( handle_early_data ( proxy, stream ) >= 0 )
+        {
+            return 0;
+        }
+        break;
+    case S_PORT_W:
+        if ( stream->level == LEVEL_WARM )
+        {
+            verbose ( "lost warm upstream socket:%i\n", stream->fd );
+            break;
+        }
+        /* fall through */
     case S_PORT_B:
         if ( ( status = handle_stream_socks ( proxy, stream ) ) >= 0 )
         {
@@ -338,11 +1266,45 @@ int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream )
         break;
     }
 
-    remove_relation ( stream );
+    remove_relation ( proxy, stream );
 
     return 0;
 }
 
+/**
+ * Handle stream state change
+ */
+void handle_stream_state ( struct proxy_t *proxy, struct stream_t *stream, int prev )
+{
+    /* Handshake and lifetime count from stream creation */
+    if ( prev < 0 && stream->state >= 0 )
+    {
+        stream->cold->created = proxy->now;
+    }
+
+    /* Idle time counts from the start of forwarding */
+    if ( stream->state == STREAM_FORWARDING )
+    {
+        stream->active = proxy->now;
+    }
+
+    /* Forwarding mode resources live as long as the stream */
+    forward_stream_state ( proxy, stream, prev );
+
+    /* Pending io_uring poll holds the slot until cancelled */
+    if ( stream->state < 0 && stream->pollref == URINGREF )
+    {
+        uring_poll_remove ( proxy, stream );
+    }
+
+    /* Closing stream no longer counts towards its upstream */
+    if ( stream->state < 0 || stream->state == STREAM_ABANDONED )
+    {
+        unbind_upstream ( proxy, stream, prev );
+    }
+
+    stream_timer_update ( proxy, stream );
+}
 
 /**
  * Proxy task entry point
@@ -351,66 +1313,195 @@ int proxy_task ( struct proxy_t *proxy )
 {
     int status = 0;
     int sock;
-    struct stream_t *stream;
+    struct stream_t *stream = NULL;
+    struct stream_t *stop = NULL;
+    struct stream_t *handoff = NULL;
 
     /* Set stream size */
     proxy->stream_size = sizeof ( struct stream_t );
+    proxy->cold_size = sizeof ( struct stream_cold_t );
 
     /* Reset current state */
     proxy->stream_head = NULL;
     proxy->stream_tail = NULL;
-    memset ( proxy->stream_pool, '\0', sizeof ( proxy->stream_pool ) );
+    proxy->dirty_head = NULL;
+    memset ( proxy->state_head, '\0', sizeof ( proxy->state_head ) );
+    memset ( proxy->state_count, '\0', sizeof ( proxy->state_count ) );
+    memset ( proxy->role_count, '\0', sizeof ( proxy->role_count ) );
+
+    /* Allocate stream pool */
+    if ( proxy_pool_alloc ( proxy ) < 0 )
+    {
+        failure ( "cannot allocate stream pool (%i)\n", errno );
+        return -1;
+    }
 
     /* Proxy events setup */
     if ( proxy_events_setup ( proxy ) < 0 )
     {
+        proxy_pool_free ( proxy );
         return -1;
     }
 
-    /* Setup listen socket */
-    if ( ( sock = listen_socket ( proxy, &proxy->entrance ) ) < 0 )
+    /* Wait with io_uring polls if preferred */
+    uring_events_setup ( proxy );
+
+    /* Select forwarding operations for preferred mode */
+    forward_ops_init ( proxy );
+
+    /* Start timer wheel at current time */
+    timer_wheel_init ( proxy );
+
+    /* Relations handed off by other threads */
+    if ( proxy->handoff )
     {
-        if ( proxy->epoll_fd >= 0 )
+        if ( !( handoff = insert_stream ( proxy, proxy->handoff->event_fd ) ) )
         {
-            close ( proxy->epoll_fd );
+            forward_ops_free ( proxy );
+            uring_free ( proxy );
+            proxy_events_free ( proxy );
+            proxy_pool_free ( proxy );
+            return -1;
         }
-        return -1;
+
+        handoff->role = L_HANDOFF;
+        handoff->events = POLLIN;
     }
 
-    /* Allocate new stream */
-    if ( !( stream = insert_stream ( proxy, sock ) ) )
+    /* Acceptor thread owns the listen socket if enabled */
+    if ( !proxy->acceptor )
     {
-        shutdown_then_close ( proxy, sock );
-        if ( proxy->epoll_fd >= 0 )
+        /* Setup listen socket unless spawner prepared one */
+        if ( ( sock = proxy->listen_fd ) < 0
+            && ( sock = listen_socket ( proxy, &proxy->entrance ) ) < 0 )
         {
-            close ( proxy->epoll_fd );
+            if ( handoff )
+            {
+                handoff->fd = -1;
+                remove_stream ( proxy, handoff );
+            }
+            forward_ops_free ( proxy );
+            uring_free ( proxy );
+            proxy_events_free ( proxy );
+            proxy_pool_free ( proxy );
+            return -1;
         }
-        return -1;
+
+        /* Allocate new stream */
+        if ( !( stream = insert_stream ( proxy, sock ) ) )
+        {
+            if ( sock != proxy->listen_fd )
+            {
+                shutdown_then_close ( proxy, sock );
+            }
+            if ( handoff )
+            {
+                handoff->fd = -1;
+                remove_stream ( proxy, handoff );
+            }
+            forward_ops_free ( proxy );
+            uring_free ( proxy );
+            proxy_events_free ( proxy );
+            proxy_pool_free ( proxy );
+            return -1;
+        }
+
+        /* Update listen stream */
+        stream->role = L_ACCEPT;
+        stream->events = POLLIN;
     }
 
-    /* Update listen stream */
-    stream->role = L_ACCEPT;
-    stream->events = POLLIN;
+    /* Watch stop event if running as a worker */
+    if ( proxy->stop_fd >= 0 )
+    {
+        if ( !( stop = insert_stream ( proxy, proxy->stop_fd ) ) )
+        {
+            if ( handoff )
+            {
+                handoff->fd = -1;
+            }
+            if ( stream && stream->fd == proxy->listen_fd )
+            {
+                stream->fd = -1;
+            }
+            remove_all_streams ( proxy );
+            forward_ops_free ( proxy );
+            uring_free ( proxy );
+            proxy_events_free ( proxy );
+            proxy_pool_free ( proxy );
+            return -1;
+        }
+
+        stop->role = L_STOP;
+        stop->events = POLLIN;
+    }
 
     verbose ( "proxy setup was successful\n" );
 
-    /* Run forward loop */
-    while ( ( status = handle_streams_cycle ( proxy ) ) >= 0 );
+    proxy->rate_stamp = get_monotonic_msec (  );
+    proxy->warm_stamp = proxy->rate_stamp;
 
-    /* Do not close reset pipe */
-    stream->fd = -1;
+    /* Warm up first upstreams before any client shows up */
+    if ( proxy->warm_max && ( proxy->handoff || !proxy->acceptor ) )
+    {
+        refill_warm_pool ( proxy );
+    }
 
-    /* Remove all streams */
-    remove_all_streams ( proxy );
+    /* Run forward loop, relations move between cycles only */
+    for ( ;; )
+    {
+        /* Events wait ends no later than the next deadline */
+        proxy->wait_timeout = timer_wait_msec ( proxy );
+
+        if ( ( status = handle_streams_cycle ( proxy ) ) < 0 )
+        {
+            break;
+        }
+
+        /* Abandon relations past their deadlines */
+        timer_wheel_advance ( proxy );
+
+        if ( __atomic_load_n ( &proxy->migrate_target, __ATOMIC_RELAXED ) )
+        {
+            migrate_relations ( proxy );
+        }
+
+        /* Whoever forwards relations keeps spares for them */
+        if ( proxy->warm_max && ( proxy->handoff || !proxy->acceptor ) )
+        {
+            refill_warm_pool ( proxy );
+        }
+    }
+
+    /* Do not close stop and hand-off events, they belong to the spawner */
+    if ( stop )
+    {
+        stop->fd = -1;
+    }
 
-    /* Close epoll fd if created */
-    if ( proxy->epoll_fd >= 0 )
+    if ( handoff )
     {
-        close ( proxy->epoll_fd );
-        proxy->epoll_fd = -1;
+        handoff->fd = -1;
     }
 
+    /* So does the listen socket if it was prepared */
+    if ( stream && stream->fd == proxy->listen_fd )
+    {
+        stream->fd = -1;
+    }
+
+    /* Remove all streams */
+    remove_all_streams ( proxy );
+
+    /* Release events listenning */
+    forward_ops_free ( proxy );
+    uring_free ( proxy );
+    proxy_events_free ( proxy );
+
+    /* Release stream pool */
+    proxy_pool_free ( proxy );
+
     verbose ( "done proxy uninitializing\n" );
 
-    return status;
+    return proxy->stopped ? 0 : status;
 }
@@ -9,25 +9,190 @@
  */
 static void show_usage ( void )
 {
-    failure ( "usage: vsocks [-vd] listen-addr:listen-port socks5-addr:socks5s-port\n\n"
+    failure ( "usage: vsocks [-vdszkueapoft] listen-addr:listen-port socks5-addr:socks5s-port[,...] "
+        "[name=value...]\n\n"
         "       option -v         Enable verbose logging\n"
         "       option -d         Run in background\n"
+        "       option -s         Forward data with splice\n"
+        "       option -z         Send large bursts with zerocopy\n"
+        "       option -k         Splice relations in kernel with sockmap\n"
+        "                         (-s, -z and -k are mutually exclusive)\n"
+        "       option -u         Poll sockets through io_uring if supported\n"
+        "       option -e         Use edge triggered epoll for forwarding\n"
+        "       option -a         Accept on one thread, forward on workers\n"
+        "       option -p         Pin workers to CPUs, steer flows by receiving CPU\n"
+        "       option -o         Send socks greeting and request at once\n"
+        "       option -f         Send client early data along with socks request\n"
+        "       option -t         Use TCP fast open toward socks server\n"
         "       listen-addr       Gateway address\n"
         "       listen-port       Gateway port\n"
         "       socks5-addr       Socks server address\n"
-        "       socks5-port       Socks-5 server port\n\n"
+        "       socks5-port       Socks-5 server port, more servers may follow after comma\n"
+        "       chunk=bytes       Initial forwarding chunk size (16384)\n"
+        "       minchunk=bytes    Adaptive chunk lower bound (2048)\n"
+        "       maxchunk=bytes    Adaptive chunk upper bound (262144)\n"
+        "       queue=bytes       Handshake queue capacity (384)\n"
+        "       pool=count        Stream pool slab size (256)\n"
+        "       maxpool=count     Stream pool size limit (16384)\n"
+        "       timeout=msec      Events poll timeout (16000)\n"
+        "       connect=msec      Upstream connect timeout (10000)\n"
+        "       handshake=msec    Relation setup timeout (16000)\n"
+        "       greeting=msec     Socks greeting stage timeout (5000)\n"
+        "       request=msec      Socks connect request stage timeout (10000)\n"
+        "       idle=msec         Forwarding idle timeout (3600000)\n"
+        "       lifetime=msec     Relation lifetime limit, 0 for none (0)\n"
+        "       warm=count        Pre-greeted upstream pool limit, 0 for none (0)\n"
+        "       warmttl=msec      Pre-greeted upstream lifetime (10000)\n"
+        "       balance=policy    Socks server choice: 1 round-robin, 2 least relations,\n"
+        "                         3 handshake latency EWMA (1)\n"
+        "       budget=bytes      Edge triggered stream budget per cycle (262144)\n"
+        "       workers=count     Worker threads with own listen socket (1)\n\n"
         "Note: Both IPv4 and IPv6 can be used\n\n" );
 }
 
+/**
+ * Parse comma separated socks server addresses
+ */
+static int parse_upstreams ( struct proxy_t *proxy, const char *input )
+{
+    size_t len;
+    const char *end;
+    char straddr[STRADDR_SIZE];
+
+    for ( ;; )
+    {
+        len = ( end = strchr ( input, ',' ) ) ? ( size_t ) ( end - input ) : strlen ( input );
+
+        if ( proxy->upstream_count >= UPSTREAMS_MAX || len >= sizeof ( straddr ) )
+        {
+            return -1;
+        }
+
+        memcpy ( straddr, input, len );
+        straddr[len] = '\0';
+
+        if ( ip_port_decode ( straddr, &proxy->upstreams[proxy->upstream_count].saddr ) < 0 )
+        {
+            return -1;
+        }
+
+        proxy->upstream_count++;
+
+        if ( !end )
+        {
+            return 0;
+        }
+
+        input = end + 1;
+    }
+}
+
+/**
+ * Set program tunables to default values
+ */
+static void set_defaults ( struct proxy_t *proxy )
+{
+    proxy_set_defaults ( proxy );
+    proxy->connect_timeout = CONNECT_TIMEOUT_MSEC;
+    proxy->handshake_timeout = HANDSHAKE_TIMEOUT_MSEC;
+    proxy->idle_timeout = IDLE_TIMEOUT_MSEC;
+    proxy->lifetime = 0;
+    proxy->greeting_timeout = GREETING_TIMEOUT_MSEC;
+    proxy->request_timeout = REQUEST_TIMEOUT_MSEC;
+    proxy->warm_max = 0;
+    proxy->warm_ttl = WARM_TTL_MSEC;
+    proxy->balance = BALANCE_RR;
+}
+
+/**
+ * Parse program tunable in name=value form, others are left to proxy util
+ */
+static int set_tunable ( struct proxy_t *proxy, const char *input )
+{
+    size_t len;
+    char *end;
+    const char *value;
+    unsigned long number;
+
+    if ( !( value = strchr ( input, '=' ) ) )
+    {
+        return -1;
+    }
+
+    len = value - input;
+    value++;
+
+    errno = 0;
+    number = strtoul ( value, &end, 10 );
+
+    if ( errno || end == value || *end || number > 0x7fffffff )
+    {
+        return -1;
+    }
+
+    /* Only limits documented with 0 for none may be zero */
+    if ( len == 8 && !strncmp ( input, "lifetime", len ) )
+    {
+        proxy->lifetime = number;
+
+    } else if ( len == 4 && !strncmp ( input, "warm", len ) )
+    {
+        proxy->warm_max = number;
+
+    } else if ( !number )
+    {
+        return -1;
+
+    } else if ( len == 7 && !strncmp ( input, "connect", len ) )
+    {
+        proxy->connect_timeout = number;
+
+    } else if ( len == 9 && !strncmp ( input, "handshake", len ) )
+    {
+        proxy->handshake_timeout = number;
+
+    } else if ( len == 4 && !strncmp ( input, "idle", len ) )
+    {
+        proxy->idle_timeout = number;
+
+    } else if ( len == 8 && !strncmp ( input, "greeting", len ) )
+    {
+        proxy->greeting_timeout = number;
+
+    } else if ( len == 7 && !strncmp ( input, "request", len ) )
+    {
+        proxy->request_timeout = number;
+
+    } else if ( len == 7 && !strncmp ( input, "warmttl", len ) )
+    {
+        proxy->warm_ttl = number;
+
+    } else if ( len == 7 && !strncmp ( input, "balance", len ) && number >= BALANCE_RR
+        && number <= BALANCE_EWMA )
+    {
+        proxy->balance = number;
+
+    } else
+    {
+        return proxy_set_tunable ( proxy, input );
+    }
+
+    return 0;
+}
+
 /**
  * Program entry point
  */
 int main ( int argc, char *argv[] )
 {
+    int i;
     int arg_off = 0;
     int daemon_flag = 0;
     struct proxy_t proxy = { 0 };
 
+    proxy.stop_fd = -1;
+    proxy.listen_fd = -1;
+
     /* Show program version */
     info ( "VSocks - ver. " VSOCKS_VERSION "\n" );
 
@@ -44,6 +209,34 @@ int main ( int argc, char *argv[] )
         arg_off = 1;
         proxy.verbose = !!strchr ( argv[1], 'v' );
         daemon_flag = !!strchr ( argv[1], 'd' );
+
+        /* Forwarding modes are mutually exclusive */
+        if ( !!strchr ( argv[1], 's' ) + !!strchr ( argv[1], 'z' ) + !!strchr ( argv[1], 'k' ) > 1 )
+        {
+            show_usage (  );
+            return 1;
+        }
+
+        if ( strchr ( argv[1], 's' ) )
+        {
+            proxy.forward_mode = FORWARD_SPLICE;
+
+        } else if ( strchr ( argv[1], 'z' ) )
+        {
+            proxy.forward_mode = FORWARD_ZEROCOPY;
+
+        } else if ( strchr ( argv[1], 'k' ) )
+        {
+            proxy.forward_mode = FORWARD_SOCKMAP;
+        }
+
+        proxy.prefer_uring = !!strchr ( argv[1], 'u' );
+        proxy.edge_triggered = !!strchr ( argv[1], 'e' );
+        proxy.acceptor = !!strchr ( argv[1], 'a' );
+        proxy.steering = !!strchr ( argv[1], 'p' );
+        proxy.pipelined = !!strchr ( argv[1], 'o' );
+        proxy.early_data = !!strchr ( argv[1], 'f' );
+        proxy.fastopen = !!strchr ( argv[1], 't' );
     }
 
     /* Re-validate arguments count */
@@ -60,8 +253,27 @@ int main ( int argc, char *argv[] )
         return 1;
     }
 
-    /* Parse proxy address and port */
-    if ( ip_port_decode ( argv[arg_off + 2], &proxy.socks5 ) < 0 )
+    /* Parse proxy addresses and ports */
+    if ( parse_upstreams ( &proxy, argv[arg_off + 2] ) < 0 )
+    {
+        show_usage (  );
+        return 1;
+    }
+
+    /* Parse optional tunables */
+    set_defaults ( &proxy );
+
+    for ( i = arg_off + 3; i < argc; i++ )
+    {
+        if ( set_tunable ( &proxy, argv[i] ) < 0 )
+        {
+            failure ( "invalid tunable: %s\n", argv[i] );
+            show_usage (  );
+            return 1;
+        }
+    }
+
+    if ( proxy_check_tunables ( &proxy ) < 0 )
     {
         show_usage (  );
         return 1;
@@ -77,8 +289,16 @@ int main ( int argc, char *argv[] )
         }
     }
 
-    /* Launch the proxy task */
-    if ( proxy_task ( &proxy ) < 0 )
+    /* Launch the proxy task, sharded across workers if requested */
+    if ( proxy.workers > 1 || proxy.acceptor )
+    {
+        if ( run_workers ( &proxy, proxy.workers ) < 0 )
+        {
+            failure ( "exit status: %i\n", errno );
+            return 1;
+        }
+
+    } else if ( proxy_task ( &proxy ) < 0 )
     {
         failure ( "exit status: %i\n", errno );
         return 1;
@@ -0,0 +1,372 @@
+/* ------------------------------------------------------------------
+ * V-Socks - Timer Wheel Source Code
+ * ------------------------------------------------------------------ */
+
+#include "vsocks.h"
+
+/* NOTE: Timer Wheel Related Functions */
+
+/**
+ * Reset timer wheel to current time
+ */
+void timer_wheel_init ( struct proxy_t *proxy )
+{
+    proxy->now = get_monotonic_msec (  );
+    proxy->wheel_tick = proxy->now / TIMER_TICK_MSEC;
+    proxy->timer_count = 0;
+    memset ( proxy->wheel, '\0', sizeof ( proxy->wheel ) );
+    memset ( proxy->wheel_map, '\0', sizeof ( proxy->wheel_map ) );
+}
+
+static const char *timeout_names[TIMEOUT_REASONS] = {
+    "connect", "greeting", "request", "handshake", "idle", "lifetime", "stale"
+};
+
+/**
+ * Get earliest deadline applicable to the stream
+ */
+static uint64_t stream_deadline ( struct proxy_t *proxy, const struct stream_t *stream,
+    int *reason )
+{
+    uint64_t active;
+    uint64_t deadline;
+    uint64_t created = stream->cold->created;
+
+    if ( stream->state == STREAM_FORWARDING )
+    {
+        /* Relation is idle only if both sides are */
+        active = stream->active;
+
+        if ( stream->neighbour && stream->neighbour->active > active )
+        {
+            active = stream->neighbour->active;
+        }
+
+        deadline = active + proxy->idle_timeout;
+        *reason = TIMEOUT_IDLE;
+
+    } else if ( stream->state == STREAM_PARKED )
+    {
+        /* Parked stream only waits for its stage to go stale */
+        deadline = stream->cold->stage_deadline;
+        *reason = stream->cold->stage_reason;
+
+    } else
+    {
+        deadline = created + proxy->handshake_timeout;
+        *reason = TIMEOUT_HANDSHAKE;
+
+        /* Current stage may fail sooner than the whole handshake */
+        if ( stream->cold->stage_deadline && stream->cold->stage_deadline < deadline )
+        {
+            deadline = stream->cold->stage_deadline;
+            *reason = stream->cold->stage_reason;
+        }
+    }
+
+    if ( proxy->lifetime && created + proxy->lifetime < deadline )
+    {
+        deadline = created + proxy->lifetime;
+        *reason = TIMEOUT_LIFETIME;
+    }
+
+    return deadline;
+}
+
+/**
+ * Remove stream from the timer wheel
+ */
+void stream_timer_cancel ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int level = stream->timer_level;
+    int slot = stream->timer_slot;
+
+    if ( !stream->timer_armed )
+    {
+        return;
+    }
+
+    if ( stream->timer_prev )
+    {
+        stream->timer_prev->timer_next = stream->timer_next;
+
+    } else
+    {
+        proxy->wheel[level][slot] = stream->timer_next;
+    }
+
+    if ( stream->timer_next )
+    {
+        stream->timer_next->timer_prev = stream->timer_prev;
+    }
+
+    if ( !proxy->wheel[level][slot] )
+    {
+        proxy->wheel_map[level][slot / 64] &= ~( 1ULL << ( slot % 64 ) );
+    }
+
+    stream->timer_armed = 0;
+    stream->timer_prev = NULL;
+    stream->timer_next = NULL;
+    proxy->timer_count--;
+}
+
+/**
+ * Put stream on the timer wheel, replacing its current deadline
+ */
+void stream_timer_arm ( struct proxy_t *proxy, struct stream_t *stream, uint64_t expires )
+{
+    int level;
+    int slot;
+    uint64_t tick;
+
+    stream_timer_cancel ( proxy, stream );
+
+    /* Never fire early, and never into the slot being processed */
+    tick = ( expires + TIMER_TICK_MSEC - 1 ) / TIMER_TICK_MSEC;
+
+    if ( tick <= proxy->wheel_tick )
+    {
+        tick = proxy->wheel_tick + 1;
+    }
+
+    if ( tick - proxy->wheel_tick < TIMER_SLOTS )
+    {
+        level = 0;
+        slot = tick & ( TIMER_SLOTS - 1 );
+
+    } else
+    {
+        /* Deadlines past the outer level wait in its last slot and get re-armed */
+        if ( ( tick >> TIMER_SLOT_BITS ) - ( proxy->wheel_tick >> TIMER_SLOT_BITS ) >= TIMER_SLOTS )
+        {
+            tick = ( ( proxy->wheel_tick >> TIMER_SLOT_BITS ) + TIMER_SLOTS - 1 )
+                << TIMER_SLOT_BITS;
+        }
+
+        level = 1;
+        slot = ( tick >> TIMER_SLOT_BITS ) & ( TIMER_SLOTS - 1 );
+    }
+
+    stream->expires = expires;
+    stream->timer_armed = 1;
+    stream->timer_level = level;
+    stream->timer_slot = slot;
+    stream->timer_prev = NULL;
+    stream->timer_next = proxy->wheel[level][slot];
+
+    if ( proxy->wheel[level][slot] )
+    {
+        proxy->wheel[level][slot]->timer_prev = stream;
+    }
+
+    proxy->wheel[level][slot] = stream;
+    proxy->wheel_map[level][slot / 64] |= 1ULL << ( slot % 64 );
+    proxy->timer_count++;
+}
+
+/**
+ * Enter handshake stage with its own deadline
+ */
+void stream_set_stage ( struct proxy_t *proxy, struct stream_t *stream, int level,
+    int timeout, int reason )
+{
+    stream->level = level;
+    stream->cold->stage_deadline = timeout ? proxy->now + timeout : 0;
+    stream->cold->stage_reason = reason;
+    stream_timer_update ( proxy, stream );
+}
+
+/**
+ * Arm stream timer for its current state
+ */
+void stream_timer_update ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int reason;
+
+    if ( stream->state == STREAM_HANDSHAKE || stream->state == STREAM_FORWARDING
+        || stream->state == STREAM_PARKED )
+    {
+        stream_timer_arm ( proxy, stream, stream_deadline ( proxy, stream, &reason ) );
+
+    } else
+    {
+        stream_timer_cancel ( proxy, stream );
+    }
+}
+
+/**
+ * Catch up stream activity from the kernel, spliced sockets never wake us up
+ */
+static void stream_sample_activity ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    uint64_t active;
+    socklen_t len = sizeof ( struct tcp_info );
+    struct tcp_info info;
+
+    if ( getsockopt ( stream->fd, IPPROTO_TCP, TCP_INFO, &info, &len ) < 0 )
+    {
+        return;
+    }
+
+    if ( info.tcpi_last_data_recv < proxy->now )
+    {
+        active = proxy->now - info.tcpi_last_data_recv;
+
+        if ( active > stream->active )
+        {
+            stream->active = active;
+        }
+    }
+}
+
+/**
+ * Handle stream timer that fired
+ */
+static void stream_timer_expire ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int reason;
+    uint64_t deadline;
+
+    /* Kernel spliced relation is idle only if its sockets say so */
+    if ( stream->state == STREAM_FORWARDING && stream->sockmap > 0 )
+    {
+        stream_sample_activity ( proxy, stream );
+
+        if ( stream->neighbour )
+        {
+            stream_sample_activity ( proxy, stream->neighbour );
+        }
+    }
+
+    /* Activity or state change may have pushed the deadline */
+    if ( ( deadline = stream_deadline ( proxy, stream, &reason ) ) > proxy->now )
+    {
+        stream_timer_arm ( proxy, stream, deadline );
+        return;
+    }
+
+    verbose ( "%s timeout on socket:%i\n", timeout_names[reason], stream->fd );
+
+    /* Upstream that stalls the handshake backs off */
+    if ( reason == TIMEOUT_CONNECT || reason == TIMEOUT_GREETING || reason == TIMEOUT_REQUEST
+        || reason == TIMEOUT_HANDSHAKE )
+    {
+        fail_upstream_handshake ( proxy, stream );
+    }
+
+    /* Relation is closed at the end of this cycle, releasing its slots */
+    proxy->timeouts[reason]++;
+    remove_relation ( proxy, stream );
+}
+
+/**
+ * Advance timer wheel to current time, expiring due streams
+ */
+void timer_wheel_advance ( struct proxy_t *proxy )
+{
+    int slot;
+    uint64_t target;
+    struct stream_t *stream;
+
+    proxy->now = get_monotonic_msec (  );
+    target = proxy->now / TIMER_TICK_MSEC;
+
+    /* Nothing to walk through */
+    if ( !proxy->timer_count )
+    {
+        proxy->wheel_tick = target;
+        return;
+    }
+
+    while ( proxy->wheel_tick < target )
+    {
+        proxy->wheel_tick++;
+
+        /* Bring next block of outer level deadlines down */
+        if ( !( proxy->wheel_tick & ( TIMER_SLOTS - 1 ) ) )
+        {
+            slot = ( proxy->wheel_tick >> TIMER_SLOT_BITS ) & ( TIMER_SLOTS - 1 );
+
+            while ( ( stream = proxy->wheel[1][slot] ) )
+            {
+                stream_timer_arm ( proxy, stream, stream->expires );
+            }
+        }
+
+        /* Streams are popped one by one, expiry may cancel their neighbours */
+        slot = proxy->wheel_tick & ( TIMER_SLOTS - 1 );
+
+        while ( ( stream = proxy->wheel[0][slot] ) )
+        {
+            stream_timer_cancel ( proxy, stream );
+            stream_timer_expire ( proxy, stream );
+        }
+    }
+}
+
+/**
+ * Get events wait timeout bounded by the next deadline
+ */
+int timer_wait_msec ( struct proxy_t *proxy )
+{
+    int slot;
+    int delta;
+    uint64_t word;
+    uint64_t next;
+    uint64_t wait;
+
+    if ( !proxy->timer_count )
+    {
+        return proxy->poll_timeout;
+    }
+
+    /* Next block boundary, unless an inner level slot comes sooner */
+    next = ( ( proxy->wheel_tick >> TIMER_SLOT_BITS ) + 1 ) << TIMER_SLOT_BITS;
+
+    for ( delta = 1; delta < TIMER_SLOTS; )
+    {
+        slot = ( proxy->wheel_tick + delta ) & ( TIMER_SLOTS - 1 );
+
+        if ( ( word = proxy->wheel_map[0][slot / 64] >> ( slot % 64 ) ) )
+        {
+            delta += __builtin_ctzll ( word );
+
+            if ( delta < TIMER_SLOTS && proxy->wheel_tick + delta < next )
+            {
+                next = proxy->wheel_tick + delta;
+            }
+            break;
+        }
+
+        delta += 64 - slot % 64;
+    }
+
+    next *= TIMER_TICK_MSEC;
+    wait = next > proxy->now ? next - proxy->now : 0;
+
+    return wait < ( uint64_t ) proxy->poll_timeout ? ( int ) wait : proxy->poll_timeout;
+}
+
+/**
+ * Show timeouts statistics
+ */
+void show_timer_stats ( struct proxy_t *proxy )
+{
+    int reason;
+    size_t timeouts = 0;
+
+    for ( reason = 0; reason < TIMEOUT_REASONS; reason++ )
+    {
+        timeouts += proxy->timeouts[reason];
+    }
+
+    if ( timeouts )
+    {
+        info ( "timeouts: connect:%i greeting:%i request:%i handshake:%i idle:%i lifetime:%i "
+            "stale:%i\n", ( int ) proxy->timeouts[TIMEOUT_CONNECT],
+            ( int ) proxy->timeouts[TIMEOUT_GREETING], ( int ) proxy->timeouts[TIMEOUT_REQUEST],
+            ( int ) proxy->timeouts[TIMEOUT_HANDSHAKE], ( int ) proxy->timeouts[TIMEOUT_IDLE],
+            ( int ) proxy->timeouts[TIMEOUT_LIFETIME], ( int ) proxy->timeouts[TIMEOUT_STALE] );
+    }
+}
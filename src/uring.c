@@ -0,0 +1,486 @@
+/* ------------------------------------------------------------------
+ * V-Socks - IO-uring Poll Backend Source Code
+ * ------------------------------------------------------------------ */
+
+#define _GNU_SOURCE
+#include "vsocks.h"
+
+/* NOTE: IO-uring Poll Related Functions */
+
+/**
+ * Setup io_uring instance
+ */
+static int uring_setup ( struct proxy_t *proxy )
+{
+    struct uring_t *uring = &proxy->uring;
+    struct io_uring_params params;
+
+    memset ( uring, '\0', sizeof ( struct uring_t ) );
+    memset ( &params, '\0', sizeof ( params ) );
+
+    /* Leave room for cancellations next to polls */
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = 4 * proxy->pool_max;
+
+    if ( ( uring->fd = syscall ( __NR_io_uring_setup, proxy->pool_size, &params ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Timed waits need extended enter arguments, multishot polls came next */
+    if ( ~params.features & IORING_FEAT_EXT_ARG || ~params.features & IORING_FEAT_RSRC_TAGS )
+    {
+        verbose ( "io_uring lacks extended arguments or multishot poll support\n" );
+        uring_free ( proxy );
+        return -1;
+    }
+
+    uring->sq_entries = params.sq_entries;
+    uring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof ( unsigned int );
+    uring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof ( struct io_uring_cqe );
+    uring->sqes_len = params.sq_entries * sizeof ( struct io_uring_sqe );
+
+    /* Both rings may share single mapping */
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if ( uring->cq_ring_len > uring->sq_ring_len )
+        {
+            uring->sq_ring_len = uring->cq_ring_len;
+        }
+        uring->cq_ring_len = uring->sq_ring_len;
+    }
+
+    if ( ( uring->sq_ring = mmap ( NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING ) ) == MAP_FAILED )
+    {
+        failure ( "cannot map io_uring submission ring (%i)\n", errno );
+        uring->sq_ring = NULL;
+        uring_free ( proxy );
+        return -1;
+    }
+
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        uring->cq_ring = uring->sq_ring;
+
+    } else if ( ( uring->cq_ring = mmap ( NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING ) ) == MAP_FAILED )
+    {
+        failure ( "cannot map io_uring completion ring (%i)\n", errno );
+        uring->cq_ring = NULL;
+        uring_free ( proxy );
+        return -1;
+    }
+
+    if ( ( uring->sqes = mmap ( NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES ) ) == MAP_FAILED )
+    {
+        failure ( "cannot map io_uring submission entries (%i)\n", errno );
+        uring->sqes = NULL;
+        uring_free ( proxy );
+        return -1;
+    }
+
+    uring->sq_head = ( unsigned int * ) ( ( uint8_t * ) uring->sq_ring + params.sq_off.head );
+    uring->sq_tail = ( unsigned int * ) ( ( uint8_t * ) uring->sq_ring + params.sq_off.tail );
+    uring->sq_mask = ( unsigned int * ) ( ( uint8_t * ) uring->sq_ring + params.sq_off.ring_mask );
+    uring->sq_array = ( unsigned int * ) ( ( uint8_t * ) uring->sq_ring + params.sq_off.array );
+    uring->cq_head = ( unsigned int * ) ( ( uint8_t * ) uring->cq_ring + params.cq_off.head );
+    uring->cq_tail = ( unsigned int * ) ( ( uint8_t * ) uring->cq_ring + params.cq_off.tail );
+    uring->cq_mask = ( unsigned int * ) ( ( uint8_t * ) uring->cq_ring + params.cq_off.ring_mask );
+    uring->cqes = ( uint8_t * ) uring->cq_ring + params.cq_off.cqes;
+
+    return 0;
+}
+
+/**
+ * Release io_uring instance
+ */
+void uring_free ( struct proxy_t *proxy )
+{
+    struct uring_t *uring = &proxy->uring;
+
+    if ( uring->sqes )
+    {
+        munmap ( uring->sqes, uring->sqes_len );
+    }
+
+    if ( uring->cq_ring && uring->cq_ring != uring->sq_ring )
+    {
+        munmap ( uring->cq_ring, uring->cq_ring_len );
+    }
+
+    if ( uring->sq_ring )
+    {
+        munmap ( uring->sq_ring, uring->sq_ring_len );
+    }
+
+    if ( uring->fd >= 0 )
+    {
+        close ( uring->fd );
+    }
+
+    memset ( uring, '\0', sizeof ( struct uring_t ) );
+    uring->fd = -1;
+}
+
+/**
+ * Submit queued entries and optionally wait for completions
+ */
+static int uring_enter ( struct proxy_t *proxy, unsigned int wait_nr, int timeout_msec )
+{
+    unsigned int flags = 0;
+    unsigned int pending;
+    struct uring_t *uring = &proxy->uring;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    pending = *uring->sq_tail - __atomic_load_n ( uring->sq_head, __ATOMIC_ACQUIRE );
+
+    memset ( &arg, '\0', sizeof ( arg ) );
+
+    if ( wait_nr )
+    {
+        ts.tv_sec = timeout_msec / 1000;
+        ts.tv_nsec = ( timeout_msec % 1000 ) * 1000000L;
+        arg.ts = ( uint64_t ) ( uintptr_t ) & ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+
+    if ( syscall ( __NR_io_uring_enter, uring->fd, pending, wait_nr, flags,
+            wait_nr ? &arg : NULL, sizeof ( arg ) ) < 0 )
+    {
+        /* Timeout is not an error */
+        return errno == ETIME ? 0 : -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Queue a single io_uring submission entry
+ */
+static int uring_queue_sqe ( struct proxy_t *proxy, int opcode, int fd, unsigned int events,
+    unsigned int flags, uint64_t addr, uint64_t user_data )
+{
+    unsigned int tail;
+    unsigned int index;
+    struct io_uring_sqe *sqe;
+    struct uring_t *uring = &proxy->uring;
+
+    tail = *uring->sq_tail;
+
+    /* Flush submission queue if full */
+    if ( tail - __atomic_load_n ( uring->sq_head, __ATOMIC_ACQUIRE ) >= uring->sq_entries )
+    {
+        if ( uring_enter ( proxy, 0, 0 ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( tail - __atomic_load_n ( uring->sq_head, __ATOMIC_ACQUIRE ) >= uring->sq_entries )
+        {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    index = tail & *uring->sq_mask;
+    sqe = ( struct io_uring_sqe * ) uring->sqes + index;
+
+    memset ( sqe, '\0', sizeof ( struct io_uring_sqe ) );
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = flags;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    sqe->poll32_events = ( events << 16 ) | ( events >> 16 );
+#else
+    sqe->poll32_events = events;
+#endif
+    sqe->user_data = user_data;
+
+    uring->sq_array[index] = index;
+    __atomic_store_n ( uring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+/**
+ * Queue stream poll request with io_uring
+ */
+static int uring_poll_add ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    unsigned int events = POLLERR | POLLHUP | stream->events;
+    unsigned int flags = 0;
+
+    /* Edge tracking stream is armed once for good with every event */
+    if ( stream->edge )
+    {
+        events = POLLIN | POLLOUT | POLLRDHUP | POLLERR | POLLHUP;
+        flags = IORING_POLL_ADD_MULTI;
+    }
+
+    if ( uring_queue_sqe ( proxy, IORING_OP_POLL_ADD, stream->fd, events, flags, 0,
+            ( uint64_t ) ( uintptr_t ) stream ) < 0 )
+    {
+        return -1;
+    }
+
+    stream->levents = stream->events;
+    stream->pollref = URINGREF;
+    stream->held = 1;
+
+    return 0;
+}
+
+/**
+ * Queue stream poll cancellation with io_uring
+ */
+int uring_poll_remove ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( uring_queue_sqe ( proxy, IORING_OP_POLL_REMOVE, -1, 0, 0,
+            ( uint64_t ) ( uintptr_t ) stream, 0 ) < 0 )
+    {
+        return -1;
+    }
+
+    stream->pollref = URINGSTOP;
+
+    return 0;
+}
+
+/**
+ * Build stream event list with io_uring
+ */
+static int build_uring_list ( struct proxy_t *proxy )
+{
+    struct stream_t *iter;
+    struct stream_t *next;
+
+    proxy->edge_pending = 0;
+
+    /* Only streams queued since last wait may need polls */
+    iter = proxy->dirty_head;
+    proxy->dirty_head = NULL;
+
+    for ( ; iter; iter = next )
+    {
+        next = iter->dirty_next;
+        iter->dirty = 0;
+        iter->dirty_prev = NULL;
+        iter->dirty_next = NULL;
+
+        if ( iter->edge )
+        {
+            if ( iter->edge == EDGE_PENDING && iter->pollref == URINGREF )
+            {
+                /* Handshake poll goes away before multishot poll replaces it */
+                if ( uring_poll_remove ( proxy, iter ) < 0 )
+                {
+                    failure ( "io_uring cannot cancel poll on socket:%i\n", iter->fd );
+                    return -1;
+                }
+
+                verbose ( "io_uring cancelling poll on socket:%i\n", iter->fd );
+
+            } else if ( iter->edge == EDGE_PENDING && !iter->pollref )
+            {
+                if ( uring_poll_add ( proxy, iter ) < 0 )
+                {
+                    failure ( "io_uring cannot poll socket:%i\n", iter->fd );
+                    return -1;
+                }
+
+                verbose ( "io_uring armed socket:%i edge triggered\n", iter->fd );
+
+                /* Edges may have passed already, assume readiness */
+                iter->ready = POLLIN | POLLOUT;
+                iter->edge = EDGE_ARMED;
+            }
+
+            /* Stream still having work must not wait for new edges */
+            if ( iter->edge == EDGE_ARMED && ( iter->ready & iter->events ) )
+            {
+                proxy->edge_pending++;
+                stream_mark_dirty ( proxy, iter );
+            }
+
+        } else if ( !iter->pollref )
+        {
+            /* Arm one-shot poll if stream awaits events */
+            if ( iter->events )
+            {
+                if ( uring_poll_add ( proxy, iter ) < 0 )
+                {
+                    failure ( "io_uring cannot poll socket:%i\n", iter->fd );
+                    return -1;
+                }
+
+                verbose ( "io_uring armed socket:%i with events: %s%s%s%s\n", iter->fd,
+                    POLL_EVENTS_TO_4xSTR ( iter->events ) );
+            }
+
+        } else if ( iter->pollref == URINGREF && iter->events != iter->levents )
+        {
+            /* Cancel stale poll, it gets re-armed once completed */
+            if ( uring_poll_remove ( proxy, iter ) < 0 )
+            {
+                failure ( "io_uring cannot cancel poll on socket:%i\n", iter->fd );
+                return -1;
+            }
+
+            verbose ( "io_uring cancelling poll on socket:%i\n", iter->fd );
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Update streams revents with io_uring
+ */
+static int update_revents_uring ( struct proxy_t *proxy )
+{
+    int nevents = 0;
+    unsigned int head;
+    unsigned int tail;
+    struct stream_t *stream;
+    struct io_uring_cqe *cqe;
+    struct uring_t *uring = &proxy->uring;
+
+    head = *uring->cq_head;
+    tail = __atomic_load_n ( uring->cq_tail, __ATOMIC_ACQUIRE );
+
+    for ( ; head != tail; head++, nevents++ )
+    {
+        cqe = ( struct io_uring_cqe * ) uring->cqes + ( head & *uring->cq_mask );
+
+        /* Cancellation requests complete without stream */
+        if ( !( stream = ( struct stream_t * ) ( uintptr_t ) cqe->user_data ) )
+        {
+            continue;
+        }
+
+        /* Multishot poll stays armed, its edges add up to known readiness */
+        if ( cqe->flags & IORING_CQE_F_MORE )
+        {
+            if ( stream->state >= 0 && stream->edge == EDGE_ARMED && cqe->res > 0 )
+            {
+                stream->ready |= cqe->res;
+                stream->revents = stream->ready & ( stream->events | POLLERR | POLLHUP );
+                verbose ( "events returned for socket:%i with events: %s%s%s%s\n", stream->fd,
+                    POLL_EVENTS_TO_4xSTR ( cqe->res ) );
+                stream_push_ready ( proxy, stream );
+            }
+            continue;
+        }
+
+        stream->pollref = NULL;
+        stream->held = 0;
+
+        /* Release stream slot held by the completed poll */
+        if ( stream->state < 0 )
+        {
+            stream_release_slot ( proxy, stream );
+            continue;
+        }
+
+        /* Poll is gone, stream needs re-arming, multishot one assuming readiness */
+        if ( stream->edge == EDGE_ARMED )
+        {
+            stream->edge = EDGE_PENDING;
+        }
+
+        stream_mark_dirty ( proxy, stream );
+
+        if ( cqe->res > 0 )
+        {
+            stream->revents = cqe->res;
+
+        } else if ( cqe->res < 0 && cqe->res != -ECANCELED )
+        {
+            stream->revents = POLLERR;
+        }
+
+        if ( stream->revents )
+        {
+            verbose ( "events returned for socket:%i with events: %s%s%s%s\n", stream->fd,
+                POLL_EVENTS_TO_4xSTR ( stream->revents ) );
+            stream_push_ready ( proxy, stream );
+        }
+    }
+
+    __atomic_store_n ( uring->cq_head, head, __ATOMIC_RELEASE );
+
+    /* Requeued edge tracking streams are still on the dirty list */
+    for ( stream = proxy->dirty_head; stream; stream = stream->dirty_next )
+    {
+        if ( stream->edge == EDGE_ARMED )
+        {
+            stream->revents = stream->ready & ( stream->events | POLLERR | POLLHUP );
+            stream_push_ready ( proxy, stream );
+        }
+    }
+
+    return nevents + proxy->edge_pending;
+}
+
+/**
+ * Watch stream events with io_uring
+ */
+static int watch_streams_uring ( struct proxy_t *proxy )
+{
+    /* Queue poll requests for streams */
+    if ( build_uring_list ( proxy ) < 0 )
+    {
+        failure ( "building io_uring list failed (%i)\n", errno );
+        return -1;
+    }
+
+    verbose ( "waiting for events with io_uring...\n" );
+
+    /* Submit requests, only peek for completions if streams were requeued */
+    if ( uring_enter ( proxy, proxy->edge_pending ? 0 : 1, proxy->wait_timeout ) < 0 )
+    {
+        failure ( "io_uring wait failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Update stream io_uring revents */
+    return update_revents_uring ( proxy );
+}
+
+
+/**
+ * Use io_uring polls for events if preferred and supported
+ */
+void uring_events_setup ( struct proxy_t *proxy )
+{
+    proxy->uring.fd = -1;
+
+    if ( !proxy->prefer_uring )
+    {
+        return;
+    }
+
+    if ( uring_setup ( proxy ) < 0 )
+    {
+        verbose ( "io_uring not supported\n" );
+        return;
+    }
+
+    /* Polls replace epoll, streams are armed from the dirty list */
+    if ( proxy->epoll_fd >= 0 )
+    {
+        close ( proxy->epoll_fd );
+        proxy->epoll_fd = -1;
+    }
+
+    proxy->watch_backend = watch_streams_uring;
+
+    /* Multishot polls report edges, forwarding streams track readiness */
+    proxy->edge_triggered = 1;
+
+    verbose ( "io_uring initialized\n" );
+}
@@ -2,6 +2,7 @@
  * Proxy Util - Source File
  * ------------------------------------------------------------------ */
 
+#define _GNU_SOURCE
 #define PROXY_UTIL_BASE_STRUCTS
 #include "util.h"
 
@@ -180,6 +181,7 @@ void format_ip_port ( const struct sockaddr_storage *saddr, char *buffer, size_t
 int connect_async ( struct proxy_t *proxy, const struct sockaddr_storage *saddr )
 {
     int sock;
+    int enable = 1;
 
     /* Create new socket */
     if ( ( sock = socket ( saddr->ss_family, SOCK_STREAM, 0 ) ) < 0 )
@@ -195,8 +197,20 @@ int connect_async ( struct proxy_t *proxy, const struct sockaddr_storage *saddr
         return -1;
     }
 
-    /* Asynchronous connect endpoint */
-    if ( connect ( sock, ( const struct sockaddr * ) saddr,
+    /* Defer SYN until first data, so it can carry the data */
+    if ( proxy->fastopen
+        && setsockopt ( sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof ( enable ) ) >= 0 )
+    {
+        if ( !connect ( sock, ( const struct sockaddr * ) saddr,
+                sizeof ( struct sockaddr_storage ) ) )
+        {
+            verbose ( "fast open connect deferred on socket:%i...\n", sock );
+            return sock;
+        }
+
+        /* Without a cookie a plain SYN goes out asking for one */
+
+    } else if ( connect ( sock, ( const struct sockaddr * ) saddr,
             sizeof ( struct sockaddr_storage ) ) >= 0 )
     {
         failure ( "cannot async-connect endpoint (%i) with socket:%i\n", errno, sock );
@@ -252,6 +266,15 @@ int listen_socket ( struct proxy_t *proxy, const struct sockaddr_storage *saddr
 
     verbose ( "done setting reuse address on socket:%i\n", sock );
 
+    /* Let kernel spread connections across sibling listeners */
+    if ( proxy->reuseport
+        && setsockopt ( sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof ( yes ) ) < 0 )
+    {
+        failure ( "cannot reuse port (%i) on socket:%i\n", errno, sock );
+        shutdown_then_close ( proxy, sock );
+        return -1;
+    }
+
     /* Bind socket to address */
     if ( bind ( sock, ( const struct sockaddr * ) saddr, sizeof ( struct sockaddr_storage ) ) < 0 )
     {
@@ -294,6 +317,38 @@ int socket_has_error ( int sock )
     return !!so_error;
 }
 
+/**
+ * Get socket send buffer size
+ */
+size_t socket_get_sndbuf ( int sock )
+{
+    int size = 0;
+    socklen_t len = sizeof ( size );
+
+    if ( getsockopt ( sock, SOL_SOCKET, SO_SNDBUF, &size, &len ) < 0 || size < 0 )
+    {
+        return 0;
+    }
+
+    return size;
+}
+
+/**
+ * Check if data sent with SYN was acknowledged
+ */
+int socket_fastopen_acked ( int sock )
+{
+    struct tcp_info info;
+    socklen_t len = sizeof ( info );
+
+    if ( getsockopt ( sock, IPPROTO_TCP, TCP_INFO, &info, &len ) < 0 )
+    {
+        return -1;
+    }
+
+    return !!( info.tcpi_options & TCPI_OPT_SYN_DATA );
+}
+
 /**
  * Set socket non-blocking mode
  */
@@ -321,121 +376,146 @@ int socket_set_nonblocking ( struct proxy_t *proxy, int sock )
 }
 
 /**
- * Forward data between sockets
+ * Read socket input into ring buffer
  */
-int socket_forward_data ( struct proxy_t *proxy, int srcfd, int dstfd )
+ssize_t socket_recv_ring ( int sock, struct ring_t *ring )
 {
-    int len = FORWARD_CHUNK_LEN;
-    int recvlim;
-    int sendlim;
-    int sendwip;
-    socklen_t optlen;
-    uint8_t buffer[FORWARD_CHUNK_LEN];
-
-    UNUSED ( proxy );
+    size_t pos;
+    size_t room;
+    ssize_t len;
+    int iovcnt = 1;
+    struct iovec iov[2];
 
-    if ( ioctl ( srcfd, FIONREAD, &recvlim ) < 0 )
+    /* Rewind empty ring to keep next read contiguous */
+    if ( !ring->len && !ring->held )
     {
-        failure ( "cannot get socket:%i available bytes count (%i)\n", srcfd, errno );
-        return -1;
+        ring->off = 0;
     }
 
-    if ( !recvlim )
-    {
-        verbose ( "lost connection on socket:%i\n", srcfd );
-        return -1;
-    }
+    pos = ( ring->off + ring->len ) % ring->size;
+    room = ring->size - ring->len - ring->held;
 
-    verbose ( "socket:%i available bytes count: %i\n", srcfd, recvlim );
+    iov[0].iov_base = ring->arr + pos;
+    iov[0].iov_len = room;
 
-    if ( recvlim < len )
+    /* Free space may wrap around ring end */
+    if ( pos + room > ring->size )
     {
-        len = recvlim;
-        verbose ( "bytes count limited to buffer size: %i\n", len );
+        iov[0].iov_len = ring->size - pos;
+        iov[1].iov_base = ring->arr;
+        iov[1].iov_len = room - iov[0].iov_len;
+        iovcnt = 2;
     }
 
-    if ( ioctl ( dstfd, TIOCOUTQ, &sendwip ) < 0 )
+    if ( ( len = readv ( sock, iov, iovcnt ) ) > 0 )
     {
-        failure ( "cannot get socket:%i pending bytes count (%i)\n", dstfd, errno );
-        return -1;
+        ring->len += len;
     }
 
-    verbose ( "socket:%i pending bytes count: %i\n", dstfd, sendwip );
-
-    optlen = sizeof ( sendlim );
+    return len;
+}
 
-    if ( getsockopt ( dstfd, SOL_SOCKET, SO_SNDBUF, &sendlim, &optlen ) < 0 )
-    {
-        failure ( "cannot get socket:%i output capacity (%i)\n", dstfd, errno );
-        return -1;
-    }
+/**
+ * Write ring buffer content into socket
+ */
+ssize_t socket_send_ring ( int sock, struct ring_t *ring, int flags )
+{
+    ssize_t len;
+    struct msghdr msg;
+    struct iovec iov[2];
 
-    if ( optlen != sizeof ( sendlim ) )
-    {
-        failure ( "socket:%i output capacity data type is invalid\n", dstfd );
-        return -1;
-    }
+    memset ( &msg, '\0', sizeof ( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
 
-    verbose ( "socket:%i output capacity: %i\n", dstfd, sendlim );
+    iov[0].iov_base = ring->arr + ring->off;
+    iov[0].iov_len = ring->len;
 
-    if ( sendwip > sendlim )
+    /* Pending data may wrap around ring end */
+    if ( ring->off + ring->len > ring->size )
     {
-        failure ( "socket:%i capacity is less than data pending\n", dstfd );
-        return -1;
+        iov[0].iov_len = ring->size - ring->off;
+        iov[1].iov_base = ring->arr;
+        iov[1].iov_len = ring->len - iov[0].iov_len;
+        msg.msg_iovlen = 2;
     }
 
-    sendlim -= sendwip;
-
-    if ( !sendlim )
+    if ( ( len = sendmsg ( sock, &msg, MSG_NOSIGNAL | flags ) ) > 0 )
     {
-        failure ( "socket:%i was expected to be write ready\n", dstfd );
-        return -1;
+        ring->off = ( ring->off + len ) % ring->size;
+        ring->len -= len;
     }
 
-    if ( sendlim < len )
-    {
-        len = sendlim;
-        verbose ( "bytes count limited to socket:%i output capacity: %i\n", dstfd, len );
-    }
+    return len;
+}
 
-    if ( !len )
-    {
-        verbose ( "socket:%i no data to be transfered into\n", dstfd );
-        return -1;
-    }
+/**
+ * Shutdown and close the socket
+ */
+void shutdown_then_close ( struct proxy_t *proxy, int sock )
+{
+    shutdown ( sock, SHUT_RDWR );
+    verbose ( "socket:%i has been shutdown\n", sock );
+    close ( sock );
+    verbose ( "socket:%i has been closed\n", sock );
+}
 
-    if ( recv ( srcfd, buffer, len, MSG_PEEK ) < len )
+/**
+ * Prefer this listener for flows received on given CPU
+ */
+int socket_set_incoming_cpu ( struct proxy_t *proxy, int sock, int cpu )
+{
+    if ( setsockopt ( sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof ( cpu ) ) < 0 )
     {
-        failure ( "cannot receive data from socket:%i\n", srcfd );
+        failure ( "cannot set incoming cpu (%i) on socket:%i\n", errno, sock );
         return -1;
     }
 
-    if ( ( len = send ( dstfd, buffer, len, MSG_NOSIGNAL ) ) < 0 )
-    {
-        failure ( "cannot send data to socket:%i\n", dstfd );
-        return -1;
-    }
+    verbose ( "set incoming cpu %i on socket:%i\n", cpu, sock );
+
+    return 0;
+}
 
-    if ( recv ( srcfd, buffer, len, 0 ) < len )
+/**
+ * Get CPU that received flow packets
+ */
+int socket_get_incoming_cpu ( int sock )
+{
+    int cpu;
+    socklen_t len = sizeof ( cpu );
+
+    if ( getsockopt ( sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len ) < 0 )
     {
-        failure ( "cannot skip data from socket:%i\n", srcfd );
         return -1;
     }
 
-    verbose ( "forwarded %i byte(s) from socket:%i to socket:%i\n", len, srcfd, dstfd );
-
-    return len;
+    return cpu;
 }
 
 /**
- * Shutdown and close the socket
+ * Select reuseport group listener by receiving CPU modulo group size
  */
-void shutdown_then_close ( struct proxy_t *proxy, int sock )
+int socket_attach_cpu_selector ( struct proxy_t *proxy, int sock, unsigned int count )
 {
-    shutdown ( sock, SHUT_RDWR );
-    verbose ( "socket:%i has been shutdown\n", sock );
-    close ( sock );
-    verbose ( "socket:%i has been closed\n", sock );
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, count},
+        {BPF_RET | BPF_A, 0, 0, 0}
+    };
+    struct sock_fprog prog = {
+        .len = sizeof ( code ) / sizeof ( code[0] ),
+        .filter = code
+    };
+
+    if ( setsockopt ( sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof ( prog ) ) < 0 )
+    {
+        failure ( "cannot attach cpu selector (%i) on socket:%i\n", errno, sock );
+        return -1;
+    }
+
+    verbose ( "attached cpu selector for %u listeners on socket:%i\n", count, sock );
+
+    return 0;
 }
 
 /* NOTE: Data Queue Related Functions */
@@ -453,7 +533,7 @@ void queue_reset ( struct queue_t *queue )
  */
 int queue_push ( struct queue_t *queue, const uint8_t * bytes, size_t len )
 {
-    if ( queue->len + len > sizeof ( queue->arr ) )
+    if ( queue->len + len > queue->capacity )
     {
         return -1;
     }
@@ -472,6 +552,20 @@ int queue_set ( struct queue_t *queue, const uint8_t * bytes, size_t len )
     return queue_push ( queue, bytes, len );
 }
 
+/**
+ * Drop leading bytes from data queue
+ */
+void queue_drop ( struct queue_t *queue, size_t len )
+{
+    if ( len > queue->len )
+    {
+        len = queue->len;
+    }
+
+    queue->len -= len;
+    memmove ( queue->arr, queue->arr + len, queue->len );
+}
+
 /**
  * Shift bytes from data queue
  */
@@ -482,6 +576,12 @@ int queue_shift ( struct queue_t *queue, int fd )
 
     if ( ( len = send ( fd, queue->arr, queue->len, MSG_NOSIGNAL ) ) < 0 )
     {
+        /* Fast open without cookie sends plain SYN, data goes after handshake */
+        if ( errno == EAGAIN || errno == EINPROGRESS )
+        {
+            return 0;
+        }
+
         return -1;
     }
 
@@ -496,426 +596,1464 @@ int queue_shift ( struct queue_t *queue, int fd )
 }
 
 /**
- * Assert minimum data length
+ * Take handshake queue for the stream from the arena
  */
-int check_enough_data ( struct proxy_t *proxy, struct stream_t *stream, size_t value )
+int stream_queue_acquire ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    if ( stream->queue.len < value )
+    size_t i;
+    size_t stride;
+    uint8_t *chunk;
+    uint8_t *arr;
+
+    if ( stream->cold->queue.arr )
     {
-        verbose ( "awaiting more bytes (%lu/%lu) from socket:%i...\n",
-            ( unsigned long ) stream->queue.len, ( unsigned long ) value, stream->fd );
-        return -1;
+        return 0;
     }
 
-    return 0;
-}
-
-/* NOTE: Event Listenning Related Functions */
-
-/**
- * Setup proxy events listenning
- */
-int proxy_events_setup ( struct proxy_t *proxy )
-{
-    /* Create epoll fd if possible */
-    if ( ( proxy->epoll_fd = epoll_create ( 0 ) ) >= 0 )
-    {
-        verbose ( "epoll initialized\n" );
+    /* Free buffers keep next link in their first bytes */
+    stride = ( proxy->queue_capacity + sizeof ( uint8_t * ) - 1 ) & ~( sizeof ( uint8_t * ) - 1 );
 
-    } else
+    if ( !proxy->queue_free )
     {
-        if ( ( proxy->epoll_fd = epoll_create1 ( 0 ) ) >= 0 )
+        if ( !( chunk = ( uint8_t * ) malloc ( sizeof ( uint8_t * ) +
+                    DATA_QUEUE_CHUNK * stride ) ) )
         {
-            verbose ( "epoll-1 initialized\n" );
+            failure ( "cannot grow handshake arena (%i)\n", errno );
+            return -1;
+        }
 
-        } else
+        memcpy ( chunk, &proxy->queue_chunks, sizeof ( uint8_t * ) );
+        proxy->queue_chunks = chunk;
+
+        for ( i = DATA_QUEUE_CHUNK; i > 0; i-- )
         {
-            verbose ( "epoll not supported\n" );
+            arr = chunk + sizeof ( uint8_t * ) + ( i - 1 ) * stride;
+            memcpy ( arr, &proxy->queue_free, sizeof ( uint8_t * ) );
+            proxy->queue_free = arr;
         }
     }
 
+    arr = proxy->queue_free;
+    memcpy ( &proxy->queue_free, arr, sizeof ( uint8_t * ) );
+    proxy->queue_in_use++;
+
+    stream->cold->queue.arr = arr;
+    stream->cold->queue.capacity = proxy->queue_capacity;
+    stream->cold->queue.len = 0;
+
     return 0;
 }
 
 /**
- * Build stream event list with poll
+ * Return handshake queue of the stream to the arena
  */
-int build_poll_list ( struct proxy_t *proxy, struct pollfd *poll_list, size_t *poll_len )
+void stream_queue_release ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    size_t poll_size;
-    size_t poll_rlen = 0;
-    struct stream_t *iter;
-    struct pollfd *pollref;
-
-    poll_size = *poll_len;
+    uint8_t *arr;
 
-    /* Reset poll references */
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    if ( !( arr = stream->cold->queue.arr ) )
     {
-        iter->pollref = NULL;
+        return;
     }
 
-    /* Append file descriptors to the poll list */
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
-    {
-        /* Assert poll list index */
-        if ( poll_rlen >= poll_size )
-        {
-            failure ( "poll list capacity exceeded\n" );
-            return -1;
-        }
+    memcpy ( arr, &proxy->queue_free, sizeof ( uint8_t * ) );
+    proxy->queue_free = arr;
+    proxy->queue_in_use--;
 
-        /* Add stream to poll list if applicable */
-        if ( iter->events )
-        {
-            pollref = poll_list + poll_rlen;
-            pollref->fd = iter->fd;
-            pollref->events = POLLERR | POLLHUP | iter->events;
-            iter->pollref = pollref;
-            poll_rlen++;
-            verbose ( "poll list push socket:%i with events: %s%s%s%s\n", pollref->fd,
-                POLL_EVENTS_TO_4xSTR ( pollref->events ) );
-        }
-    }
+    stream->cold->queue.arr = NULL;
+    stream->cold->queue.capacity = 0;
+    stream->cold->queue.len = 0;
+}
 
-    verbose ( "poll list length is %lu event(s)\n", ( unsigned long ) poll_rlen );
-    *poll_len = poll_rlen;
+/**
+ * Assert minimum data length
+ */
+int check_enough_data ( struct proxy_t *proxy, struct stream_t *stream, size_t value )
+{
+    if ( stream->cold->queue.len < value )
+    {
+        verbose ( "awaiting more bytes (%lu/%lu) from socket:%i...\n",
+            ( unsigned long ) stream->cold->queue.len, ( unsigned long ) value, stream->fd );
+        return -1;
+    }
 
     return 0;
 }
 
+/* NOTE: Ring Buffer Related Functions */
+
 /**
- * Update streams revents with poll
+ * Allocate ring buffer storage
  */
-void update_revents_poll ( struct proxy_t *proxy )
+int ring_alloc ( struct ring_t *ring, size_t size )
 {
-    struct stream_t *iter;
-
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    if ( !( ring->arr = ( uint8_t * ) malloc ( size ) ) )
     {
-        iter->revents = iter->pollref ? iter->pollref->revents : 0;
-        if ( proxy->verbose )
-        {
-            if ( iter->revents )
-            {
-                verbose ( "events returned for socket:%i: %s%s%s%s\n", iter->fd,
-                    POLL_EVENTS_TO_4xSTR ( iter->revents ) );
-            }
-        }
+        return -1;
     }
+
+    ring->size = size;
+    ring->off = 0;
+    ring->len = 0;
+    ring->held = 0;
+    return 0;
 }
 
 /**
- * Watch stream events with poll
+ * Release ring buffer storage
  */
-int watch_streams_poll ( struct proxy_t *proxy )
+void ring_free ( struct ring_t *ring )
 {
-    int nfds;
-    size_t poll_len;
-    struct pollfd poll_list[POOL_SIZE];
+    free ( ring->arr );
+    ring->arr = NULL;
+    ring->size = 0;
+    ring->off = 0;
+    ring->len = 0;
+    ring->held = 0;
+}
 
-    /* Set poll list size */
-    poll_len = sizeof ( poll_list ) / sizeof ( struct pollfd );
+/**
+ * Change ring buffer storage size while empty
+ */
+int ring_resize ( struct ring_t *ring, size_t size )
+{
+    uint8_t *arr;
 
-    /* Rebuild poll event list */
-    if ( build_poll_list ( proxy, poll_list, &poll_len ) < 0 )
+    /* Data or sends in flight may still reference the storage */
+    if ( ring->len || ring->held )
     {
-        failure ( "building poll list failed (%i)\n", errno );
         return -1;
     }
 
-    verbose ( "waiting for events with poll...\n" );
-
-    /* Poll events */
-    if ( ( nfds = poll ( poll_list, poll_len, POLL_TIMEOUT_MSEC ) ) < 0 )
+    if ( !( arr = ( uint8_t * ) malloc ( size ) ) )
     {
-        failure ( "poll events failed (%i)\n", errno );
         return -1;
     }
 
-    /* Update stream poll revents */
-    update_revents_poll ( proxy );
-
-    return nfds;
+    free ( ring->arr );
+    ring->arr = arr;
+    ring->size = size;
+    ring->off = 0;
+    return 0;
 }
 
+/* NOTE: Time Related Functions */
+
 /**
- * Convert poll to epoll events
+ * Get monotonic time in milliseconds
  */
-int poll_to_epoll_events ( int poll_events )
+uint64_t get_monotonic_msec ( void )
 {
-    int epoll_events = 0;
+    struct timespec ts;
 
-    if ( poll_events & POLLERR )
-    {
-        epoll_events |= EPOLLERR;
-    }
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
 
-    if ( poll_events & POLLHUP )
-    {
-        epoll_events |= EPOLLHUP;
-    }
+    return ( uint64_t ) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if ( poll_events & POLLIN )
-    {
-        epoll_events |= EPOLLIN;
-    }
+/**
+ * Get monotonic time in microseconds
+ */
+uint64_t get_monotonic_usec ( void )
+{
+    struct timespec ts;
 
-    if ( poll_events & POLLOUT )
-    {
-        epoll_events |= EPOLLOUT;
-    }
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
 
-    return epoll_events;
+    return ( uint64_t ) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+/* NOTE: Proxy Tunables Related Functions */
+
 /**
- * Convert epoll to poll events
+ * Set proxy tunables to default values
  */
-int epoll_to_poll_events ( int epoll_events )
+void proxy_set_defaults ( struct proxy_t *proxy )
 {
-    int poll_events = 0;
+    proxy->pool_size = POOL_SIZE;
+    proxy->pool_max = 0;
+    proxy->queue_capacity = DATA_QUEUE_CAPACITY;
+    proxy->chunk_len = FORWARD_CHUNK_LEN;
+    proxy->chunk_min = 0;
+    proxy->chunk_max = 0;
+    proxy->poll_timeout = POLL_TIMEOUT_MSEC;
+    proxy->wait_timeout = POLL_TIMEOUT_MSEC;
+    proxy->edge_budget = EDGE_BUDGET_BYTES;
+    proxy->workers = 1;
+}
 
-    if ( epoll_events & EPOLLERR )
+/**
+ * Parse proxy tunable in name=value form
+ */
+int proxy_set_tunable ( struct proxy_t *proxy, const char *input )
+{
+    size_t len;
+    char *end;
+    const char *value;
+    unsigned long number;
+
+    if ( !( value = strchr ( input, '=' ) ) )
     {
-        poll_events |= POLLERR;
+        return -1;
     }
 
-    if ( epoll_events & EPOLLHUP )
+    len = value - input;
+    value++;
+
+    errno = 0;
+    number = strtoul ( value, &end, 10 );
+
+    if ( errno || end == value || *end || !number || number > 0x7fffffff )
     {
-        poll_events |= POLLHUP;
+        return -1;
     }
 
-    if ( epoll_events & EPOLLIN )
+    if ( len == 5 && !strncmp ( input, "chunk", len ) )
     {
-        poll_events |= POLLIN;
+        proxy->chunk_len = number;
+
+    } else if ( len == 8 && !strncmp ( input, "minchunk", len ) )
+    {
+        proxy->chunk_min = number;
+
+    } else if ( len == 8 && !strncmp ( input, "maxchunk", len ) )
+    {
+        proxy->chunk_max = number;
+
+    } else if ( len == 5 && !strncmp ( input, "queue", len ) && number >= DATA_QUEUE_MIN )
+    {
+        proxy->queue_capacity = number;
+
+    } else if ( len == 4 && !strncmp ( input, "pool", len ) && number >= 2 )
+    {
+        proxy->pool_size = number;
+
+    } else if ( len == 7 && !strncmp ( input, "maxpool", len ) && number >= 2 )
+    {
+        proxy->pool_max = number;
+
+    } else if ( len == 7 && !strncmp ( input, "timeout", len ) )
+    {
+        proxy->poll_timeout = number;
+        proxy->wait_timeout = number;
+
+    } else if ( len == 6 && !strncmp ( input, "budget", len ) )
+    {
+        proxy->edge_budget = number;
+
+    } else if ( len == 7 && !strncmp ( input, "workers", len ) && number <= WORKERS_MAX )
+    {
+        proxy->workers = number;
+
+    } else
+    {
+        return -1;
     }
 
-    if ( epoll_events & EPOLLOUT )
+    return 0;
+}
+
+/**
+ * Complete unset limits and validate tunables once all are parsed
+ */
+int proxy_check_tunables ( struct proxy_t *proxy )
+{
+    /* Default limits stretch to cover the values given */
+    if ( !proxy->pool_max )
     {
-        poll_events |= POLLOUT;
+        proxy->pool_max = proxy->pool_size > POOL_MAX_SIZE ? proxy->pool_size : POOL_MAX_SIZE;
     }
 
-    return epoll_events;
+    if ( !proxy->chunk_min )
+    {
+        proxy->chunk_min =
+            proxy->chunk_len < FORWARD_CHUNK_MIN ? proxy->chunk_len : FORWARD_CHUNK_MIN;
+    }
+
+    if ( !proxy->chunk_max )
+    {
+        proxy->chunk_max =
+            proxy->chunk_len > FORWARD_CHUNK_MAX ? proxy->chunk_len : FORWARD_CHUNK_MAX;
+    }
+
+    /* Pool grows by whole slabs up to the limit */
+    if ( proxy->pool_size > proxy->pool_max )
+    {
+        failure ( "pool size exceeds pool limit\n" );
+        return -1;
+    }
+
+    /* Adaptive chunk range must hold the initial chunk */
+    if ( proxy->chunk_min > proxy->chunk_len || proxy->chunk_max < proxy->chunk_len )
+    {
+        failure ( "chunk size outside adaptive chunk range\n" );
+        return -1;
+    }
+
+    return 0;
 }
 
 /**
- * Build stream event list with epoll
+ * Allocate stream pool with the first slab
  */
-int build_epoll_list ( struct proxy_t *proxy )
+int proxy_pool_alloc ( struct proxy_t *proxy )
 {
-    int operation;
+    size_t max_slabs;
+
+    proxy->pool_capacity = 0;
+    proxy->slab_count = 0;
+    proxy->free_head = NULL;
+    proxy->queue_free = NULL;
+    proxy->queue_chunks = NULL;
+    proxy->queue_in_use = 0;
+    max_slabs = ( proxy->pool_max + proxy->pool_size - 1 ) / proxy->pool_size;
+
+    if ( !( proxy->slabs = ( uint8_t ** ) calloc ( max_slabs, sizeof ( uint8_t * ) ) ) )
+    {
+        return -1;
+    }
+
+    if ( proxy_pool_grow ( proxy ) < 0 )
+    {
+        free ( proxy->slabs );
+        proxy->slabs = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Add a slab of streams to the free list
+ */
+int proxy_pool_grow ( struct proxy_t *proxy )
+{
+    size_t i;
+    size_t count;
+    size_t event_size;
+    void *event_list;
+    void *slab;
+    uint8_t *cold_arr;
+    struct stream_t *stream;
+    struct stream_t **ready_list;
+
+    if ( proxy->pool_capacity >= proxy->pool_max )
+    {
+        return -1;
+    }
+
+    count = proxy->pool_max - proxy->pool_capacity;
+
+    if ( count > proxy->pool_size )
+    {
+        count = proxy->pool_size;
+    }
+
+    /* Event lists must hold every stream */
+    if ( proxy->event_list )
+    {
+        event_size = sizeof ( struct epoll_event ) > sizeof ( struct pollfd ) ?
+            sizeof ( struct epoll_event ) : sizeof ( struct pollfd );
+
+        if ( !( event_list = realloc ( proxy->event_list,
+                    ( proxy->pool_capacity + count ) * event_size ) ) )
+        {
+            failure ( "cannot grow event list (%i)\n", errno );
+            return -1;
+        }
+
+        proxy->event_list = event_list;
+
+        if ( !( ready_list = ( struct stream_t ** ) realloc ( proxy->ready_list,
+                    ( proxy->pool_capacity + count ) * sizeof ( struct stream_t * ) ) ) )
+        {
+            failure ( "cannot grow ready list (%i)\n", errno );
+            return -1;
+        }
+
+        proxy->ready_list = ready_list;
+    }
+
+    /* Cache aligned hot streams first, then cold parts */
+    if ( ( errno = posix_memalign ( &slab, CACHE_LINE_SIZE,
+                count * ( proxy->stream_size + proxy->cold_size ) ) ) )
+    {
+        failure ( "cannot allocate stream slab (%i)\n", errno );
+        return -1;
+    }
+
+    memset ( slab, '\0', count * ( proxy->stream_size + proxy->cold_size ) );
+    cold_arr = ( uint8_t * ) slab + count * proxy->stream_size;
+
+    /* Push slots in reverse so lower ones are handed out first */
+    for ( i = count; i > 0; i-- )
+    {
+        stream = ( struct stream_t * ) ( ( uint8_t * ) slab + ( i - 1 ) * proxy->stream_size );
+        stream->cold = ( struct stream_cold_t * ) ( cold_arr + ( i - 1 ) * proxy->cold_size );
+        stream->next = proxy->free_head;
+        proxy->free_head = stream;
+    }
+
+    proxy->slabs[proxy->slab_count++] = ( uint8_t * ) slab;
+    __atomic_store_n ( &proxy->pool_capacity, proxy->pool_capacity + count, __ATOMIC_RELAXED );
+
+    verbose ( "stream pool grown to %lu slot(s)\n", ( unsigned long ) proxy->pool_capacity );
+
+    return 0;
+}
+
+/**
+ * Release stream pool slabs
+ */
+void proxy_pool_free ( struct proxy_t *proxy )
+{
+    size_t i;
+    uint8_t *chunk;
+
+    for ( i = 0; i < proxy->slab_count; i++ )
+    {
+        free ( proxy->slabs[i] );
+    }
+
+    free ( proxy->slabs );
+    proxy->slabs = NULL;
+    proxy->slab_count = 0;
+    proxy->pool_capacity = 0;
+    proxy->free_head = NULL;
+
+    /* Handshake queues are released with their arena chunks */
+    while ( ( chunk = proxy->queue_chunks ) )
+    {
+        memcpy ( &proxy->queue_chunks, chunk, sizeof ( uint8_t * ) );
+        free ( chunk );
+    }
+
+    proxy->queue_free = NULL;
+    proxy->queue_in_use = 0;
+}
+
+/* NOTE: Event Listenning Related Functions */
+
+/**
+ * Setup proxy events listenning
+ */
+int proxy_events_setup ( struct proxy_t *proxy )
+{
+    size_t event_size;
+
+    proxy->epoll_fd = -1;
+    proxy->watch_backend = NULL;
+
+    /* Event list is shared by poll and epoll */
+    event_size = sizeof ( struct epoll_event ) > sizeof ( struct pollfd ) ?
+        sizeof ( struct epoll_event ) : sizeof ( struct pollfd );
+
+    if ( !( proxy->event_list = calloc ( proxy->pool_capacity, event_size ) ) )
+    {
+        failure ( "cannot allocate event list (%i)\n", errno );
+        return -1;
+    }
+
+    /* Ready list holds each stream at most once */
+    if ( !( proxy->ready_list =
+            ( struct stream_t ** ) calloc ( proxy->pool_capacity,
+                sizeof ( struct stream_t * ) ) ) )
+    {
+        failure ( "cannot allocate ready list (%i)\n", errno );
+        free ( proxy->event_list );
+        proxy->event_list = NULL;
+        return -1;
+    }
+
+    proxy->ready_len = 0;
+    proxy->now = get_monotonic_msec (  );
+
+    /* Create epoll fd if possible */
+    if ( ( proxy->epoll_fd = epoll_create ( 0 ) ) >= 0 )
+    {
+        verbose ( "epoll initialized\n" );
+
+    } else
+    {
+        if ( ( proxy->epoll_fd = epoll_create1 ( 0 ) ) >= 0 )
+        {
+            verbose ( "epoll-1 initialized\n" );
+
+        } else
+        {
+            verbose ( "epoll not supported\n" );
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Release proxy events listenning
+ */
+void proxy_events_free ( struct proxy_t *proxy )
+{
+    if ( proxy->epoll_fd >= 0 )
+    {
+        close ( proxy->epoll_fd );
+        proxy->epoll_fd = -1;
+    }
+
+    free ( proxy->event_list );
+    proxy->event_list = NULL;
+    free ( proxy->ready_list );
+    proxy->ready_list = NULL;
+}
+
+/**
+ * Queue stream with returned events for dispatch
+ */
+void stream_push_ready ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->ready_queued || proxy->ready_len >= proxy->pool_capacity )
+    {
+        return;
+    }
+
+    stream->ready_queued = 1;
+    proxy->ready_list[proxy->ready_len++] = stream;
+}
+
+/**
+ * Build stream event list with poll
+ */
+int build_poll_list ( struct proxy_t *proxy, struct pollfd *poll_list, size_t *poll_len )
+{
+    size_t poll_size;
+    size_t poll_rlen = 0;
     struct stream_t *iter;
-    struct epoll_event event;
+    struct pollfd *pollref;
+
+    poll_size = *poll_len;
+
+    /* Reset poll references */
+    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    {
+        iter->pollref = NULL;
+    }
 
     /* Append file descriptors to the poll list */
     for ( iter = proxy->stream_head; iter; iter = iter->next )
     {
+        /* Assert poll list index */
+        if ( poll_rlen >= poll_size )
+        {
+            failure ( "poll list capacity exceeded\n" );
+            return -1;
+        }
+
+        /* Add stream to poll list if applicable */
         if ( iter->events )
         {
-            if ( !iter->pollref || iter->events != iter->levents )
-            {
-                event.data.ptr = iter;
-                event.events = poll_to_epoll_events ( iter->events | POLLERR | POLLHUP );
-                operation = iter->pollref ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            pollref = poll_list + poll_rlen;
+            pollref->fd = iter->fd;
+            pollref->events = POLLERR | POLLHUP | iter->events;
+            iter->pollref = pollref;
+            poll_rlen++;
+            verbose ( "poll list push socket:%i with events: %s%s%s%s\n", pollref->fd,
+                POLL_EVENTS_TO_4xSTR ( pollref->events ) );
+        }
+    }
 
-                if ( epoll_ctl ( proxy->epoll_fd, operation, iter->fd, &event ) < 0 )
-                {
-                    failure ( "epoll list cannot update socket:%i with events 0x%.2x\n", iter->fd,
-                        event.events );
-                    return -1;
-                }
+    verbose ( "poll list length is %lu event(s)\n", ( unsigned long ) poll_rlen );
+    *poll_len = poll_rlen;
 
-                verbose ( "epoll list updated socket:%i with events: %s%s%s%s\n", iter->fd,
-                    EPOLL_EVENTS_TO_4xSTR ( event.events ) );
+    return 0;
+}
 
-                iter->levents = iter->events;
-                iter->pollref = EPOLLREF;
-            }
+/**
+ * Update streams revents with poll
+ */
+void update_revents_poll ( struct proxy_t *proxy )
+{
+    struct stream_t *iter;
 
-        } else if ( iter->pollref )
+    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    {
+        iter->revents = iter->pollref ? iter->pollref->revents : 0;
+        if ( iter->revents )
         {
-            verbose ( "epoll list removed socket:%i\n", proxy->epoll_fd );
+            verbose ( "events returned for socket:%i: %s%s%s%s\n", iter->fd,
+                POLL_EVENTS_TO_4xSTR ( iter->revents ) );
+            stream_push_ready ( proxy, iter );
+        }
+    }
+}
+
+/**
+ * Watch stream events with poll
+ */
+int watch_streams_poll ( struct proxy_t *proxy )
+{
+    int nfds;
+    size_t poll_len;
+    struct pollfd *poll_list = ( struct pollfd * ) proxy->event_list;
+
+    /* Set poll list size */
+    poll_len = proxy->pool_capacity;
+
+    /* Rebuild poll event list */
+    if ( build_poll_list ( proxy, poll_list, &poll_len ) < 0 )
+    {
+        failure ( "building poll list failed (%i)\n", errno );
+        return -1;
+    }
+
+    verbose ( "waiting for events with poll...\n" );
+
+    /* Poll events */
+    if ( ( nfds = poll ( poll_list, poll_len, proxy->wait_timeout ) ) < 0 )
+    {
+        failure ( "poll events failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Update stream poll revents */
+    update_revents_poll ( proxy );
+
+    return nfds;
+}
+
+/**
+ * Convert poll to epoll events
+ */
+int poll_to_epoll_events ( int poll_events )
+{
+    int epoll_events = 0;
+
+    if ( poll_events & POLLERR )
+    {
+        epoll_events |= EPOLLERR;
+    }
+
+    if ( poll_events & POLLHUP )
+    {
+        epoll_events |= EPOLLHUP;
+    }
+
+    if ( poll_events & POLLIN )
+    {
+        epoll_events |= EPOLLIN;
+    }
+
+    if ( poll_events & POLLOUT )
+    {
+        epoll_events |= EPOLLOUT;
+    }
+
+    if ( poll_events & POLLRDHUP )
+    {
+        epoll_events |= EPOLLRDHUP;
+    }
+
+    return epoll_events;
+}
+
+/**
+ * Convert epoll to poll events
+ */
+int epoll_to_poll_events ( int epoll_events )
+{
+    int poll_events = 0;
+
+    if ( epoll_events & EPOLLERR )
+    {
+        poll_events |= POLLERR;
+    }
+
+    if ( epoll_events & EPOLLHUP )
+    {
+        poll_events |= POLLHUP;
+    }
+
+    if ( epoll_events & EPOLLIN )
+    {
+        poll_events |= POLLIN;
+    }
+
+    if ( epoll_events & EPOLLOUT )
+    {
+        poll_events |= POLLOUT;
+    }
+
+    if ( epoll_events & EPOLLRDHUP )
+    {
+        poll_events |= POLLRDHUP;
+    }
+
+    return epoll_events;
+}
+
+/**
+ * Build stream event list with epoll
+ */
+int build_epoll_list ( struct proxy_t *proxy )
+{
+    int operation;
+    struct stream_t *iter;
+    struct stream_t *next;
+    struct epoll_event event;
+
+    proxy->edge_pending = 0;
+
+    /* Only streams queued since last wait may have changed interest */
+    iter = proxy->dirty_head;
+    proxy->dirty_head = NULL;
+
+    for ( ; iter; iter = next )
+    {
+        next = iter->dirty_next;
+        iter->dirty = 0;
+        iter->dirty_prev = NULL;
+        iter->dirty_next = NULL;
+
+        if ( iter->edge )
+        {
+            /* Edge triggered stream is registered once for good */
+            if ( iter->edge == EDGE_PENDING )
+            {
+                event.data.ptr = iter;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLHUP | EPOLLET;
+                operation = iter->pollref ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+                if ( epoll_ctl ( proxy->epoll_fd, operation, iter->fd, &event ) < 0 )
+                {
+                    failure ( "epoll list cannot arm socket:%i edge triggered\n", iter->fd );
+                    return -1;
+                }
+
+                verbose ( "epoll list armed socket:%i edge triggered\n", iter->fd );
+
+                /* Edges may have passed already, assume readiness */
+                iter->ready = POLLIN | POLLOUT;
+                iter->edge = EDGE_ARMED;
+                iter->pollref = EPOLLREF;
+            }
+
+            /* Stream still having work must not wait for new edges */
+            if ( iter->ready & iter->events )
+            {
+                proxy->edge_pending++;
+                stream_mark_dirty ( proxy, iter );
+            }
+
+        } else if ( iter->events )
+        {
+            if ( !iter->pollref || iter->events != iter->levents )
+            {
+                event.data.ptr = iter;
+                event.events = poll_to_epoll_events ( iter->events | POLLERR | POLLHUP );
+                operation = iter->pollref ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+                if ( epoll_ctl ( proxy->epoll_fd, operation, iter->fd, &event ) < 0 )
+                {
+                    failure ( "epoll list cannot update socket:%i with events 0x%.2x\n", iter->fd,
+                        event.events );
+                    return -1;
+                }
+
+                verbose ( "epoll list updated socket:%i with events: %s%s%s%s\n", iter->fd,
+                    EPOLL_EVENTS_TO_4xSTR ( event.events ) );
+
+                iter->levents = iter->events;
+                iter->pollref = EPOLLREF;
+            }
+
+        } else if ( iter->pollref )
+        {
+            verbose ( "epoll list removed socket:%i\n", proxy->epoll_fd );
+
+            if ( epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_DEL, iter->fd, NULL ) < 0 )
+            {
+                return -1;
+            }
+
+            iter->pollref = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Update streams revents with poll
+ */
+void update_revents_epoll ( struct proxy_t *proxy, int nfds, struct epoll_event *events )
+{
+    int i;
+    struct stream_t *stream;
+
+    for ( i = 0; i < nfds; i++ )
+    {
+        if ( ( stream = events[i].data.ptr ) )
+        {
+            stream->revents = epoll_to_poll_events ( events[i].events );
+
+            if ( proxy->verbose )
+            {
+                if ( stream->revents )
+                {
+                    verbose ( "events returned for socket:%i with events: %s%s%s%s\n", stream->fd,
+                        POLL_EVENTS_TO_4xSTR ( stream->revents ) );
+                }
+            }
+
+            /* Edges only add up to known readiness */
+            if ( stream->edge == EDGE_ARMED )
+            {
+                stream->ready |= stream->revents;
+            }
+
+            stream_push_ready ( proxy, stream );
+        }
+    }
+
+    /* Edge triggered streams are served while ready and interested */
+    if ( proxy->edge_triggered )
+    {
+        for ( i = 0; i < nfds; i++ )
+        {
+            if ( ( stream = events[i].data.ptr ) && stream->edge == EDGE_ARMED )
+            {
+                stream->revents = stream->ready & ( stream->events | POLLERR | POLLHUP );
+            }
+        }
+
+        /* Requeued streams are still on the dirty list */
+        for ( stream = proxy->dirty_head; stream; stream = stream->dirty_next )
+        {
+            if ( stream->edge == EDGE_ARMED )
+            {
+                stream->revents = stream->ready & ( stream->events | POLLERR | POLLHUP );
+                stream_push_ready ( proxy, stream );
+            }
+        }
+    }
+}
+
+/**
+ * Watch stream events with epoll
+ */
+int watch_streams_epoll ( struct proxy_t *proxy )
+{
+    int nfds;
+    int timeout;
+    struct epoll_event *events = ( struct epoll_event * ) proxy->event_list;
+
+    /* Rebuild epoll event list */
+    if ( build_epoll_list ( proxy ) < 0 )
+    {
+        failure ( "building epoll list failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Only peek for events if edge triggered streams were requeued */
+    timeout = proxy->edge_pending ? 0 : proxy->wait_timeout;
+
+    verbose ( "waiting for events with epoll...\n" );
+
+    /* E-Poll events */
+    if ( ( nfds = epoll_wait ( proxy->epoll_fd, events, proxy->pool_capacity, timeout ) ) < 0 )
+    {
+        failure ( "epoll wait failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Update stream epoll revents */
+    update_revents_epoll ( proxy, nfds, events );
+
+    return nfds + proxy->edge_pending;
+}
+
+/**
+ * Watch stream events
+ */
+int watch_streams ( struct proxy_t *proxy )
+{
+    int status;
+
+    /* Previous batch has been dispatched */
+    proxy->ready_len = 0;
+
+    /* Program may bring its own events backend */
+    if ( proxy->watch_backend )
+    {
+        status = proxy->watch_backend ( proxy );
+
+    } else if ( proxy->epoll_fd >= 0 )
+    {
+        status = watch_streams_epoll ( proxy );
+
+    } else
+    {
+        status = watch_streams_poll ( proxy );
+    }
+
+    /* Events of this cycle are stamped with the time of wakeup */
+    proxy->now = get_monotonic_msec (  );
+
+    return status;
+}
+
+/* NOTE: Stream Related Functions */
+
+/**
+ * Return stream slot to the free list
+ */
+void stream_release_slot ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    stream->allocated = 0;
+    stream->next = proxy->free_head;
+    proxy->free_head = stream;
+}
+
+/**
+ * Insert new stream structure into the list
+ */
+struct stream_t *insert_stream ( struct proxy_t *proxy, int sock )
+{
+    struct stream_t *stream;
+    struct stream_cold_t *cold;
+
+    /* Grow by a slab before evicting anyone */
+    if ( !proxy->free_head && proxy_pool_grow ( proxy ) < 0 )
+    {
+        failure ( "stream pool is full\n" );
+        return NULL;
+    }
+
+    stream = proxy->free_head;
+    proxy->free_head = stream->next;
+    cold = stream->cold;
+
+    memset ( stream, '\0', proxy->stream_size );
+    memset ( cold, '\0', proxy->cold_size );
+    stream->cold = cold;
+    stream->active = proxy->now;
+    stream->role = S_INVALID;
+    stream->fd = sock;
+    stream->level = LEVEL_NONE;
+    stream->allocated = 1;
+    stream->next = proxy->stream_head;
+
+    if ( proxy->stream_head )
+    {
+        proxy->stream_head->prev = stream;
+
+    } else
+    {
+        proxy->stream_tail = stream;
+    }
+
+    proxy->stream_head = stream;
+
+    stream->state = -1;
+    stream_set_state ( proxy, stream, STREAM_IDLE );
+    stream_mark_dirty ( proxy, stream );
+
+    verbose ( "created new stream with socket:%i\n", sock );
+
+    return stream;
+}
+
+/**
+ * Unlink stream from the list of its state
+ */
+static void stream_unlink_state ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->state < 0 )
+    {
+        return;
+    }
+
+    if ( stream->state_prev )
+    {
+        stream->state_prev->state_next = stream->state_next;
+
+    } else
+    {
+        proxy->state_head[stream->state] = stream->state_next;
+    }
+
+    if ( stream->state_next )
+    {
+        stream->state_next->state_prev = stream->state_prev;
+    }
+
+    /* Single writer, relaxed stores keep readers of other threads safe */
+    __atomic_store_n ( &proxy->state_count[stream->state], proxy->state_count[stream->state] - 1,
+        __ATOMIC_RELAXED );
+    __atomic_store_n ( &proxy->role_count[stream->state][stream->state_role],
+        proxy->role_count[stream->state][stream->state_role] - 1, __ATOMIC_RELAXED );
+
+    stream->state = -1;
+    stream->state_prev = NULL;
+    stream->state_next = NULL;
+}
+
+/**
+ * Move stream into the list of given state
+ */
+void stream_set_state ( struct proxy_t *proxy, struct stream_t *stream, int state )
+{
+    int prev = stream->state;
+
+    stream_unlink_state ( proxy, stream );
+
+    /* Role is sampled on entry so counters stay balanced */
+    switch ( stream->role )
+    {
+    case S_PORT_A:
+        stream->state_role = STREAM_ROLE_A;
+        break;
+    case S_PORT_B:
+        stream->state_role = STREAM_ROLE_B;
+        break;
+    default:
+        stream->state_role = STREAM_ROLE_OTHER;
+    }
+
+    stream->state = state;
+    stream->state_prev = NULL;
+    stream->state_next = proxy->state_head[state];
+
+    if ( proxy->state_head[state] )
+    {
+        proxy->state_head[state]->state_prev = stream;
+    }
+
+    proxy->state_head[state] = stream;
+    __atomic_store_n ( &proxy->state_count[state], proxy->state_count[state] + 1,
+        __ATOMIC_RELAXED );
+    __atomic_store_n ( &proxy->role_count[state][stream->state_role],
+        proxy->role_count[state][stream->state_role] + 1, __ATOMIC_RELAXED );
+
+    handle_stream_state ( proxy, stream, prev );
+}
+
+/**
+ * Queue stream for events interest sync
+ */
+void stream_mark_dirty ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    /* Poll rebuilds whole list anyway */
+    if ( stream->dirty || ( proxy->epoll_fd < 0 && !proxy->watch_backend ) )
+    {
+        return;
+    }
+
+    stream->dirty = 1;
+    stream->dirty_prev = NULL;
+    stream->dirty_next = proxy->dirty_head;
+
+    if ( proxy->dirty_head )
+    {
+        proxy->dirty_head->dirty_prev = stream;
+    }
+
+    proxy->dirty_head = stream;
+}
+
+/**
+ * Drop stream from events interest sync queue
+ */
+void stream_clear_dirty ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( !stream->dirty )
+    {
+        return;
+    }
+
+    if ( stream->dirty_prev )
+    {
+        stream->dirty_prev->dirty_next = stream->dirty_next;
+
+    } else
+    {
+        proxy->dirty_head = stream->dirty_next;
+    }
+
+    if ( stream->dirty_next )
+    {
+        stream->dirty_next->dirty_prev = stream->dirty_prev;
+    }
+
+    stream->dirty = 0;
+    stream->dirty_prev = NULL;
+    stream->dirty_next = NULL;
+}
+
+/**
+ * Accept a new stream
+ */
+struct stream_t *accept_new_stream ( struct proxy_t *proxy, int lfd )
+{
+    int sock;
+    struct stream_t *stream;
+
+    /* Accept incoming connection */
+    if ( ( sock = accept ( lfd, NULL, NULL ) ) < 0 )
+    {
+        failure ( "cannot accept incoming connection (%i) on socket:%i\n", errno, lfd );
+        return NULL;
+    }
+
+    /* Set non-blocking mode on socket */
+    if ( socket_set_nonblocking ( proxy, sock ) < 0 )
+    {
+        shutdown_then_close ( proxy, sock );
+        return NULL;
+    }
+
+    /* Try allocating new stream */
+    if ( !( stream = insert_stream ( proxy, sock ) ) )
+    {
+        verbose ( "stream pool is full, need to force cleanup...\n" );
+        force_cleanup ( proxy, NULL );
+        stream = insert_stream ( proxy, sock );
+    }
+
+    /* Check if stream was allocated */
+    if ( !stream )
+    {
+        shutdown_then_close ( proxy, sock );
+        return NULL;
+    }
+
+    return stream;
+}
+
+/**
+ * Allocate first ring of a stream, leftover handshake data fits whole
+ */
+static int stream_first_ring_alloc ( struct stream_t *stream )
+{
+    size_t len = stream->cold->queue.len;
+
+    /* Data buffered ahead of forwarding keeps its ring */
+    if ( stream->ring.arr )
+    {
+        return 0;
+    }
+
+    return ring_alloc ( &stream->ring, len > stream->chunk ? len : stream->chunk );
+}
+
+/**
+ * Move bytes left in handshake queue into forwarding buffer
+ */
+static int stream_carry_queue ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    struct queue_t *queue = &stream->cold->queue;
+
+    /* Data buffered ahead of forwarding waits for the neighbour too */
+    if ( stream->ring.len )
+    {
+        stream->neighbour->events |= POLLOUT;
+    }
 
-            if ( epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_DEL, iter->fd, NULL ) < 0 )
-            {
-                return -1;
-            }
+    if ( !queue->len )
+    {
+        return 0;
+    }
 
-            iter->pollref = NULL;
-        }
+    if ( queue->len > stream->ring.size - stream->ring.len )
+    {
+        failure ( "cannot carry handshake data on socket:%i\n", stream->fd );
+        return -1;
     }
 
+    memcpy ( stream->ring.arr + stream->ring.len, queue->arr, queue->len );
+    stream->ring.len += queue->len;
+
+    verbose ( "carried %i byte(s) of handshake data from socket:%i\n", ( int ) queue->len,
+        stream->fd );
+
+    /* Neighbour has data to take as soon as it is writable */
+    stream->neighbour->events |= POLLOUT;
+    queue_reset ( queue );
+
     return 0;
 }
 
 /**
- * Update streams revents with poll
+ * Hand handshake leftovers of both streams over to forwarding
  */
-void update_revents_epoll ( struct proxy_t *proxy, int nfds, struct epoll_event *events )
+static int relation_carry_queues ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    int i;
-    struct stream_t *stream;
+    struct stream_t *neighbour = stream->neighbour;
 
-    for ( stream = proxy->stream_head; stream; stream = stream->next )
+    if ( stream_carry_queue ( proxy, stream ) < 0 || stream_carry_queue ( proxy, neighbour ) < 0 )
     {
-        stream->revents = 0;
+        return -1;
     }
 
-    for ( i = 0; i < nfds; i++ )
-    {
-        if ( ( stream = events[i].data.ptr ) )
-        {
-            stream->revents = epoll_to_poll_events ( events[i].events );
+    /* Handshake data is no longer needed */
+    stream_queue_release ( proxy, stream );
+    stream_queue_release ( proxy, neighbour );
 
-            if ( proxy->verbose )
-            {
-                if ( stream->revents )
-                {
-                    verbose ( "events returned for socket:%i with events: %s%s%s%s\n", stream->fd,
-                        POLL_EVENTS_TO_4xSTR ( stream->revents ) );
-                }
-            }
-        }
-    }
+    return 0;
 }
 
 /**
- * Watch stream events with epoll
+ * Switch relation into forwarding mode
  */
-int watch_streams_epoll ( struct proxy_t *proxy )
+int setup_forwarding ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    int nfds;
-    struct epoll_event events[POOL_SIZE];
+    int status;
+    struct stream_t *neighbour = stream->neighbour;
 
-    /* Rebuild epoll event list */
-    if ( build_epoll_list ( proxy ) < 0 )
+    /* Update levels and events flags */
+    stream->level = LEVEL_FORWARDING;
+    stream->events = POLLIN;
+    neighbour->level = LEVEL_FORWARDING;
+    neighbour->events = POLLIN;
+    stream_set_state ( proxy, stream, STREAM_FORWARDING );
+    stream_set_state ( proxy, neighbour, STREAM_FORWARDING );
+
+    /* Start with configured chunk, it adapts to the flow later */
+    stream->chunk = proxy->chunk_len;
+    neighbour->chunk = proxy->chunk_len;
+
+    /* Cache send buffer sizes instead of querying them per chunk */
+    stream->sndbuf = socket_get_sndbuf ( stream->fd );
+    neighbour->sndbuf = socket_get_sndbuf ( neighbour->fd );
+
+    /* Forwarding mode may take the relation over with its own buffers */
+    if ( proxy->forward_ops && proxy->forward_ops->setup
+        && ( status = proxy->forward_ops->setup ( proxy, stream ) ) )
     {
-        failure ( "building epoll list failed (%i)\n", errno );
-        return -1;
+        return status < 0 ? -1 : 0;
     }
 
-    verbose ( "waiting for events with epoll...\n" );
-
-    /* E-Poll events */
-    if ( ( nfds = epoll_wait ( proxy->epoll_fd, events, POOL_SIZE, POLL_TIMEOUT_MSEC ) ) < 0 )
+    /* Allocate ring buffers otherwise */
+    if ( stream_first_ring_alloc ( stream ) < 0 || stream_first_ring_alloc ( neighbour ) < 0 )
     {
-        failure ( "epoll wait failed (%i)\n", errno );
+        failure ( "cannot allocate ring buffer for socket:%i\n", stream->fd );
         return -1;
     }
 
-    /* Update stream epoll revents */
-    update_revents_epoll ( proxy, nfds, events );
+    /* Ring forwarding can track readiness itself with epoll or backend edges */
+    if ( proxy->edge_triggered && ( proxy->epoll_fd >= 0 || proxy->watch_backend ) )
+    {
+        stream->edge = EDGE_PENDING;
+        neighbour->edge = EDGE_PENDING;
+    }
 
-    return nfds;
+    return relation_carry_queues ( proxy, stream );
 }
 
 /**
- * Watch stream events
+ * Get count of stream input bytes ahead
  */
-int watch_streams ( struct proxy_t *proxy )
+size_t stream_pending_data ( const struct stream_t *stream )
 {
-    if ( proxy->epoll_fd >= 0 )
+    if ( stream->forward_ops && stream->forward_ops->pending )
     {
-        return watch_streams_epoll ( proxy );
+        return stream->forward_ops->pending ( stream );
     }
 
-    return watch_streams_poll ( proxy );
+    return stream->ring.len;
 }
 
-/* NOTE: Stream Related Functions */
+/**
+ * Mark stream socket send buffer as full
+ */
+void stream_mark_full ( struct stream_t *stream )
+{
+    stream->sndfull = 1;
+    stream->ready &= ~POLLOUT;
+}
 
 /**
- * Insert new stream structure into the list
+ * Adapt stream chunk size to bytes seen per readiness event
  */
-struct stream_t *insert_stream ( struct proxy_t *proxy, int sock )
+static void stream_adapt_chunk ( struct proxy_t *proxy, struct stream_t *stream, size_t len )
 {
-    struct stream_t *ptr;
-    struct stream_t *lim;
-    struct stream_t *stream = NULL;
+    size_t chunk = stream->chunk;
+    size_t limit = proxy->chunk_max;
+    struct stream_t *neighbour = stream->neighbour;
 
-    ptr = proxy->stream_pool;
-    lim =
-        ( struct stream_t * ) ( ( ( uint8_t * ) proxy->stream_pool ) +
-        POOL_SIZE * proxy->stream_size );
+    /* Smoothed average, new sample weighs one quarter */
+    stream->fill_avg = ( 3 * stream->fill_avg + len ) / 4;
 
-    while ( ptr < lim )
+    /* Reading ahead more than the neighbour can queue buys nothing */
+    if ( len >= chunk && neighbour->sndbuf && neighbour->sndbuf < limit )
     {
-        if ( !ptr->allocated )
+        /* Send buffer is autotuned, sample it now and then */
+        if ( chunk >= neighbour->sndbuf && ++neighbour->sndbuf_age >= SNDBUF_SAMPLE_PERIOD )
+        {
+            neighbour->sndbuf = socket_get_sndbuf ( neighbour->fd );
+            neighbour->sndbuf_age = 0;
+        }
+
+        if ( neighbour->sndbuf && neighbour->sndbuf < limit )
         {
-            stream = ptr;
-            break;
+            limit = neighbour->sndbuf > proxy->chunk_len ? neighbour->sndbuf : proxy->chunk_len;
         }
-        ptr = ( struct stream_t * ) ( ( ( uint8_t * ) ptr ) + proxy->stream_size );
     }
 
-    if ( !stream )
+    /* Grow on bulk transfers filling the chunk, shrink on small reads */
+    if ( len >= chunk && chunk < limit )
     {
-        failure ( "stream pool is full\n" );
-        return NULL;
+        chunk = 2 * chunk < limit ? 2 * chunk : limit;
+
+    } else if ( 8 * stream->fill_avg < chunk && chunk > proxy->chunk_min )
+    {
+        chunk = chunk / 2 > proxy->chunk_min ? chunk / 2 : proxy->chunk_min;
     }
 
-    memset ( stream, '\0', proxy->stream_size );
-    stream->role = S_INVALID;
-    stream->fd = sock;
-    stream->level = LEVEL_NONE;
-    stream->allocated = 1;
-    stream->next = proxy->stream_head;
+    if ( chunk != stream->chunk )
+    {
+        verbose ( "chunk of socket:%i adapted from %lu to %lu byte(s)\n", stream->fd,
+            ( unsigned long ) stream->chunk, ( unsigned long ) chunk );
+        stream->chunk = chunk;
+    }
+}
 
-    if ( proxy->stream_head )
+/**
+ * Read stream input ahead
+ */
+static int stream_fill_data ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    ssize_t len;
+
+    if ( stream->forward_ops && stream->forward_ops->fill )
     {
-        proxy->stream_head->prev = stream;
+        if ( ( len = stream->forward_ops->fill ( proxy, stream ) ) > 0 )
+        {
+            stream_adapt_chunk ( proxy, stream, len );
+        }
+        return len;
+    }
 
-    } else
+    /* Apply adapted chunk size once ring is empty */
+    if ( stream->ring.size != stream->chunk && ring_resize ( &stream->ring, stream->chunk ) >= 0 )
     {
-        proxy->stream_tail = stream;
+        verbose ( "ring of socket:%i resized to %lu byte(s)\n", stream->fd,
+            ( unsigned long ) stream->chunk );
     }
 
-    proxy->stream_head = stream;
+    if ( ( len = socket_recv_ring ( stream->fd, &stream->ring ) ) < 0 )
+    {
+        /* Only exhausted input can wait for next edge, a peer close may follow data */
+        if ( errno == EAGAIN )
+        {
+            stream->ready &= ~POLLIN;
+            return 0;
+        }
 
-    verbose ( "created new stream with socket:%i\n", sock );
+        failure ( "cannot receive data (%i) from socket:%i\n", errno, stream->fd );
+        return -1;
+    }
 
-    return stream;
+    if ( !len )
+    {
+        verbose ( "lost connection on socket:%i\n", stream->fd );
+        stream->eof = 1;
+        return 0;
+    }
+
+    verbose ( "received %i byte(s) from socket:%i\n", ( int ) len, stream->fd );
+
+    stream_adapt_chunk ( proxy, stream, len );
+
+    return len;
 }
 
 /**
- * Accept a new stream
+ * Pass stream input ahead to neighbour
  */
-struct stream_t *accept_new_stream ( struct proxy_t *proxy, int lfd )
+static int stream_drain_data ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    int sock;
-    struct stream_t *stream;
+    ssize_t len;
+    size_t pending;
 
-    /* Accept incoming connection */
-    if ( ( sock = accept ( lfd, NULL, NULL ) ) < 0 )
+    /* Skip sending while neighbour is known to be full */
+    if ( !( pending = stream_pending_data ( stream ) ) || stream->neighbour->sndfull )
     {
-        failure ( "cannot accept incoming connection (%i) on socket:%i\n", errno, lfd );
-        return NULL;
+        return 0;
     }
 
-    /* Set non-blocking mode on socket */
-    if ( socket_set_nonblocking ( proxy, sock ) < 0 )
+    if ( stream->forward_ops && stream->forward_ops->drain )
     {
-        shutdown_then_close ( proxy, sock );
-        return NULL;
+        if ( ( len = stream->forward_ops->drain ( proxy, stream ) ) >= 0
+            && ( size_t ) len < pending )
+        {
+            stream_mark_full ( stream->neighbour );
+        }
+        return len;
     }
 
-    /* Try allocating new stream */
-    if ( !( stream = insert_stream ( proxy, sock ) ) )
+    if ( ( len = socket_send_ring ( stream->neighbour->fd, &stream->ring, 0 ) ) < 0 )
     {
-        verbose ( "stream pool is full, need to force cleanup...\n" );
-        force_cleanup ( proxy, NULL );
-        stream = insert_stream ( proxy, sock );
+        if ( errno == EAGAIN )
+        {
+            stream_mark_full ( stream->neighbour );
+            return 0;
+        }
+
+        failure ( "cannot send data (%i) to socket:%i\n", errno, stream->neighbour->fd );
+        return -1;
     }
 
-    /* Check if stream was allocated */
-    if ( !stream )
+    /* Short write means send buffer got full */
+    if ( ( size_t ) len < pending )
     {
-        shutdown_then_close ( proxy, sock );
-        return NULL;
+        stream_mark_full ( stream->neighbour );
     }
 
-    return stream;
+    verbose ( "forwarded %i byte(s) from socket:%i to socket:%i\n", ( int ) len, stream->fd,
+        stream->neighbour->fd );
+
+    return len;
+}
+
+/**
+ * Check if stream input can be read ahead
+ */
+static int stream_can_fill ( const struct stream_t *stream )
+{
+    if ( stream->eof )
+    {
+        return 0;
+    }
+
+    if ( stream->forward_ops && stream->forward_ops->can_fill )
+    {
+        return stream->forward_ops->can_fill ( stream );
+    }
+
+    return stream->ring.len + stream->ring.held < stream->ring.size;
+}
+
+/**
+ * Update forwarding stream events flags
+ */
+static void update_forward_events ( struct stream_t *stream )
+{
+    stream->events = 0;
+
+    if ( stream_can_fill ( stream ) )
+    {
+        stream->events |= POLLIN;
+    }
+
+    if ( stream_pending_data ( stream->neighbour ) )
+    {
+        stream->events |= POLLOUT;
+    }
+
+    /* Forwarding mode may need more events watched */
+    if ( stream->forward_ops && stream->forward_ops->events )
+    {
+        stream->forward_ops->events ( stream );
+    }
 }
 
 /**
@@ -923,27 +2061,70 @@ struct stream_t *accept_new_stream ( struct proxy_t *proxy, int lfd )
  */
 int handle_forward_data ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    if ( !stream->neighbour || stream->level != LEVEL_FORWARDING )
+    int len;
+    int status;
+    struct stream_t *neighbour = stream->neighbour;
+
+    if ( !neighbour || stream->level != LEVEL_FORWARDING )
     {
         return -1;
     }
 
+    stream->active = proxy->now;
+
+    /* Forwarding mode may serve the relation without buffers */
+    if ( stream->forward_ops && stream->forward_ops->intercept
+        && ( status = stream->forward_ops->intercept ( proxy, stream ) ) )
+    {
+        return status < 0 ? -1 : 0;
+    }
+
+    /* Read input ahead unless carried handshake data filled the buffer */
+    if ( ( stream->revents & POLLIN ) && stream_can_fill ( stream ) )
+    {
+        if ( ( len = stream_fill_data ( proxy, stream ) ) < 0
+            || stream_drain_data ( proxy, stream ) < 0 )
+        {
+            return -1;
+        }
+
+        stream->spent += len;
+
+        /* Sampled by the rebalancer from another thread */
+        stream->forwarded += len;
+        __atomic_store_n ( &proxy->forwarded, proxy->forwarded + len, __ATOMIC_RELAXED );
+    }
+
+    /* Drain neighbour input into the stream */
     if ( stream->revents & POLLOUT )
     {
-        if ( socket_forward_data ( proxy, stream->neighbour->fd, stream->fd ) < 0 )
+        stream->sndfull = 0;
+
+        if ( ( len = stream_drain_data ( proxy, neighbour ) ) < 0 )
         {
             return -1;
         }
 
-        stream->events &= ~POLLOUT;
-        stream->neighbour->events |= POLLIN;
+        stream->spent += len;
+    }
 
-    } else if ( stream->revents & POLLIN )
+    /* Drop relation once closed side has been drained */
+    if ( ( stream->eof && !stream_pending_data ( stream ) && !stream->ring.held )
+        || ( neighbour->eof && !stream_pending_data ( neighbour ) && !neighbour->ring.held ) )
     {
-        stream->events &= ~POLLIN;
-        stream->neighbour->events |= POLLOUT;
+        return -1;
+    }
+
+    /* Forwarding mode may take the relation over once nothing is in flight */
+    if ( stream->forward_ops && stream->forward_ops->settle
+        && !stream_pending_data ( stream ) && !stream_pending_data ( neighbour ) )
+    {
+        stream->forward_ops->settle ( proxy, stream );
     }
 
+    update_forward_events ( stream );
+    update_forward_events ( neighbour );
+
     return 0;
 }
 
@@ -952,37 +2133,29 @@ int handle_forward_data ( struct proxy_t *proxy, struct stream_t *stream )
  */
 void show_stats ( struct proxy_t *proxy )
 {
-    int a_forwarding = 0;
-    int b_forwarding = 0;
-    int a_total = 0;
-    int b_total = 0;
-    int total = 0;
-    struct stream_t *iter;
+    int state;
+    size_t a_total = 0;
+    size_t b_total = 0;
+    size_t total = 0;
 
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    for ( state = 0; state < STREAM_STATES; state++ )
     {
-        if ( iter->role == S_PORT_A )
-        {
-            if ( iter->level == LEVEL_FORWARDING )
-            {
-                a_forwarding++;
-            }
-            a_total++;
+        a_total += proxy->role_count[state][STREAM_ROLE_A];
+        b_total += proxy->role_count[state][STREAM_ROLE_B];
+        total += proxy->state_count[state];
+    }
 
-        } else if ( iter->role == S_PORT_B )
-        {
-            if ( iter->level == LEVEL_FORWARDING )
-            {
-                b_forwarding++;
-            }
-            b_total++;
-        }
+    info ( "load: A:%i/%i B:%i/%i *:%i/%i Q:%i P:%i\n",
+        ( int ) proxy->role_count[STREAM_FORWARDING][STREAM_ROLE_A], ( int ) a_total,
+        ( int ) proxy->role_count[STREAM_FORWARDING][STREAM_ROLE_B], ( int ) b_total,
+        ( int ) total, ( int ) proxy->pool_capacity, ( int ) proxy->queue_in_use,
+        ( int ) proxy->state_count[STREAM_PARKED] );
 
-        total++;
+    if ( proxy->fastopen )
+    {
+        info ( "fastopen: acked:%i fallback:%i\n", ( int ) proxy->fastopen_acked,
+            ( int ) proxy->fastopen_fallback );
     }
-
-    info ( "load: A:%i/%i B:%i/%i *:%i/%i\n", a_forwarding, a_total, b_forwarding,
-        b_total, total, POOL_SIZE );
 }
 
 /**
@@ -990,9 +2163,11 @@ void show_stats ( struct proxy_t *proxy )
  */
 void remove_stream ( struct proxy_t *proxy, struct stream_t *stream )
 {
+    int prev = stream->state;
+
     if ( stream->fd >= 0 )
     {
-        if ( stream->pollref )
+        if ( stream->pollref == EPOLLREF )
         {
             epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL );
         }
@@ -1001,6 +2176,12 @@ void remove_stream ( struct proxy_t *proxy, struct stream_t *stream )
         stream->fd = -1;
     }
 
+    ring_free ( &stream->ring );
+    stream_queue_release ( proxy, stream );
+    stream_clear_dirty ( proxy, stream );
+    stream_unlink_state ( proxy, stream );
+    handle_stream_state ( proxy, stream, prev );
+
     if ( stream == proxy->stream_head )
     {
         proxy->stream_head = stream->next;
@@ -1021,19 +2202,29 @@ void remove_stream ( struct proxy_t *proxy, struct stream_t *stream )
         stream->prev->next = stream->next;
     }
 
-    stream->allocated = 0;
+    /* Slot held by a pending request is released by its holder */
+    if ( !stream->held )
+    {
+        stream_release_slot ( proxy, stream );
+    }
 }
 
 /*
  * Abandon associated pair of streams
  */
-void remove_relation ( struct stream_t *stream )
+void remove_relation ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    if ( stream->neighbour )
+    if ( stream->neighbour && !stream->neighbour->abandoned )
     {
         stream->neighbour->abandoned = 1;
+        stream_set_state ( proxy, stream->neighbour, STREAM_ABANDONED );
+    }
+
+    if ( !stream->abandoned )
+    {
+        stream->abandoned = 1;
+        stream_set_state ( proxy, stream, STREAM_ABANDONED );
     }
-    stream->abandoned = 1;
 }
 
 /**
@@ -1050,25 +2241,6 @@ void remove_all_streams ( struct proxy_t *proxy )
     {
         next = iter->next;
         remove_stream ( proxy, iter );
-        iter = next;
-    }
-}
-
-/**
- * Remove pending streams
- */
-void remove_pending_streams ( struct proxy_t *proxy )
-{
-    struct stream_t *iter;
-
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
-    {
-        if ( ( iter->role == S_PORT_A || iter->role == S_PORT_B )
-            && iter->level != LEVEL_FORWARDING )
-        {
-            verbose ( "cleaning up pending stream with socket:%i...\n", iter->fd );
-            remove_relation ( iter );
-        }
     }
 }
 
@@ -1078,16 +2250,10 @@ void remove_pending_streams ( struct proxy_t *proxy )
 void cleanup_streams ( struct proxy_t *proxy )
 {
     struct stream_t *iter;
-    struct stream_t *next;
 
-    for ( iter = proxy->stream_head; iter; iter = next )
+    while ( ( iter = proxy->state_head[STREAM_ABANDONED] ) )
     {
-        next = iter->next;
-
-        if ( iter->abandoned )
-        {
-            remove_stream ( proxy, iter );
-        }
+        remove_stream ( proxy, iter );
     }
 }
 
@@ -1098,23 +2264,31 @@ void force_cleanup ( struct proxy_t *proxy, const struct stream_t *excl )
 {
     struct stream_t *iter;
 
-    for ( iter = proxy->stream_tail; iter; iter = iter->prev )
+    for ( iter = proxy->state_head[STREAM_ABANDONED]; iter; iter = iter->state_next )
     {
-        if ( iter != excl && iter->abandoned )
+        if ( iter != excl )
         {
             verbose ( "will remove an abandoned stream with socket:%i...\n", iter->fd );
-            remove_relation ( iter );
+            remove_relation ( proxy, iter );
             remove_stream ( proxy, iter );
             return;
         }
     }
 
+    /* Parked streams are spare, drop them before live relations */
+    if ( ( iter = proxy->state_head[STREAM_PARKED] ) && iter != excl )
+    {
+        verbose ( "will remove a parked stream with socket:%i...\n", iter->fd );
+        remove_stream ( proxy, iter );
+        return;
+    }
+
     for ( iter = proxy->stream_tail; iter; iter = iter->prev )
     {
         if ( iter != excl && ( iter->role == S_PORT_A || iter->role == S_PORT_B ) )
         {
             verbose ( "need to get rid of stream with socket:%i...\n", iter->fd );
-            remove_relation ( iter );
+            remove_relation ( proxy, iter );
             remove_stream ( proxy, iter );
             return;
         }
@@ -1127,8 +2301,9 @@ void force_cleanup ( struct proxy_t *proxy, const struct stream_t *excl )
 int handle_streams_cycle ( struct proxy_t *proxy )
 {
     int status;
+    size_t i;
+    size_t spent;
     struct stream_t *iter;
-    struct stream_t *next;
 
     /* Cleanup streams */
     cleanup_streams ( proxy );
@@ -1143,32 +2318,72 @@ int handle_streams_cycle ( struct proxy_t *proxy )
     /* Do some cleanup */
     if ( !status )
     {
-        remove_pending_streams ( proxy );
         cleanup_streams ( proxy );
         show_stats ( proxy );
         return 0;
     }
 
-    /* Process stream list */
-    for ( iter = proxy->stream_head; iter; iter = next )
+    /* Process only streams with returned events, slots stay valid within the batch */
+    for ( i = 0; i < proxy->ready_len; i++ )
     {
-        next = iter->next;
+        iter = proxy->ready_list[i];
+        iter->ready_queued = 0;
 
         if ( !iter->abandoned && iter->revents )
         {
+            /* Forwarding mode may report its completions as socket errors */
+            if ( ( iter->revents & POLLERR ) && iter->forward_ops && iter->forward_ops->reap )
+            {
+                if ( iter->forward_ops->reap ( proxy, iter ) >= 0 )
+                {
+                    iter->revents &= ~POLLERR;
+                    iter->ready &= ~POLLERR;
+                }
+            }
+
             if ( iter->revents & ( POLLERR | POLLHUP ) )
             {
                 verbose ( "stream with socket:%i got POLLERR/POLLHUP...\n", iter->fd );
-                remove_relation ( iter );
+                remove_relation ( proxy, iter );
 
             } else
             {
+                iter->spent = 0;
+
                 if ( handle_stream_events ( proxy, iter ) < 0 )
                 {
                     return -1;
                 }
+
+                /* Serve edge triggered stream while ready, within budget */
+                while ( iter->edge == EDGE_ARMED && !iter->abandoned
+                    && iter->spent < proxy->edge_budget
+                    && ( iter->revents = iter->ready & iter->events & ~POLLERR ) )
+                {
+                    spent = iter->spent;
+
+                    if ( handle_stream_events ( proxy, iter ) < 0 )
+                    {
+                        return -1;
+                    }
+
+                    if ( iter->spent == spent )
+                    {
+                        break;
+                    }
+                }
+
+                /* Handling may change interest of the relation */
+                stream_mark_dirty ( proxy, iter );
+
+                if ( iter->neighbour )
+                {
+                    stream_mark_dirty ( proxy, iter->neighbour );
+                }
             }
         }
+
+        iter->revents = 0;
     }
 
     return 0;
@@ -0,0 +1,820 @@
+/* ------------------------------------------------------------------
+ * V-Socks - Worker Threads Source Code
+ * ------------------------------------------------------------------ */
+
+#define _GNU_SOURCE
+#include "vsocks.h"
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+/**
+ * Worker thread structure
+ */
+struct worker_t
+{
+    int index;
+    int status;
+    int started;
+    pthread_t thread;
+    struct proxy_t proxy;
+    struct handoff_queue_t handoff;
+    size_t sampled;
+    size_t rate;
+    int cpu;
+    cpu_set_t cpus;
+};
+
+/**
+ * Acceptor thread structure
+ */
+struct acceptor_t
+{
+    int status;
+    int started;
+    pthread_t thread;
+    struct proxy_t proxy;
+    struct worker_t *workers;
+    int count;
+    int next;
+};
+
+/* NOTE: Hand-off Queue Related Functions */
+
+/**
+ * Setup hand-off queue with wakeup event
+ */
+int handoff_queue_init ( struct handoff_queue_t *queue, size_t capacity )
+{
+    size_t i;
+    size_t size = 1;
+
+    /* Slot index is masked, capacity must be a power of two */
+    while ( size < capacity )
+    {
+        size <<= 1;
+    }
+
+    if ( !( queue->slots =
+            ( struct handoff_slot_t * ) calloc ( size, sizeof ( struct handoff_slot_t ) ) ) )
+    {
+        failure ( "cannot allocate hand-off queue (%i)\n", errno );
+        return -1;
+    }
+
+    for ( i = 0; i < size; i++ )
+    {
+        queue->slots[i].seq = i;
+    }
+
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+
+    if ( ( queue->event_fd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+    {
+        failure ( "cannot create hand-off event (%i)\n", errno );
+        free ( queue->slots );
+        queue->slots = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Release hand-off queue, closing relations left inside
+ */
+void handoff_queue_free ( struct handoff_queue_t *queue )
+{
+    struct handoff_t item;
+
+    if ( !queue->slots )
+    {
+        return;
+    }
+
+    while ( handoff_pop ( queue, &item ) >= 0 )
+    {
+        close ( item.a_fd );
+
+        if ( item.b_fd >= 0 )
+        {
+            close ( item.b_fd );
+        }
+    }
+
+    close ( queue->event_fd );
+    free ( queue->slots );
+    queue->slots = NULL;
+}
+
+/**
+ * Enqueue relation and wake consumer up
+ */
+int handoff_push ( struct handoff_queue_t *queue, const struct handoff_t *item )
+{
+    size_t pos;
+    size_t seq;
+    ssize_t diff;
+    uint64_t value = 1;
+    struct handoff_slot_t *slot;
+
+    pos = __atomic_load_n ( &queue->tail, __ATOMIC_RELAXED );
+
+    /* Claim a slot whose sequence matches the tail position */
+    for ( ;; )
+    {
+        slot = &queue->slots[pos & queue->mask];
+        seq = __atomic_load_n ( &slot->seq, __ATOMIC_ACQUIRE );
+        diff = ( ssize_t ) seq - ( ssize_t ) pos;
+
+        if ( !diff )
+        {
+            if ( __atomic_compare_exchange_n ( &queue->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                    __ATOMIC_RELAXED ) )
+            {
+                break;
+            }
+
+        } else if ( diff < 0 )
+        {
+            return -1;
+
+        } else
+        {
+            pos = __atomic_load_n ( &queue->tail, __ATOMIC_RELAXED );
+        }
+    }
+
+    /* Publish the item to the consumer */
+    slot->item = *item;
+    __atomic_store_n ( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+
+    if ( write ( queue->event_fd, &value, sizeof ( value ) ) < 0 && errno != EAGAIN )
+    {
+        failure ( "cannot signal hand-off event (%i)\n", errno );
+    }
+
+    return 0;
+}
+
+/**
+ * Dequeue relation, consumer side only
+ */
+int handoff_pop ( struct handoff_queue_t *queue, struct handoff_t *item )
+{
+    size_t pos;
+    struct handoff_slot_t *slot;
+
+    pos = queue->head;
+    slot = &queue->slots[pos & queue->mask];
+
+    /* Slot not yet published */
+    if ( __atomic_load_n ( &slot->seq, __ATOMIC_ACQUIRE ) != pos + 1 )
+    {
+        return -1;
+    }
+
+    *item = slot->item;
+
+    /* Hand the slot back to producers for the next lap */
+    __atomic_store_n ( &slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE );
+    __atomic_store_n ( &queue->head, pos + 1, __ATOMIC_RELAXED );
+
+    return 0;
+}
+
+/**
+ * Get count of relations waiting in the queue
+ */
+size_t handoff_queue_len ( struct handoff_queue_t *queue )
+{
+    size_t head;
+    size_t tail;
+
+    head = __atomic_load_n ( &queue->head, __ATOMIC_RELAXED );
+    tail = __atomic_load_n ( &queue->tail, __ATOMIC_RELAXED );
+
+    return tail > head ? tail - head : 0;
+}
+
+/* NOTE: Worker Threads Related Functions */
+
+/**
+ * Worker thread entry point
+ */
+static void *worker_main ( void *arg )
+{
+    struct worker_t *worker = ( struct worker_t * ) arg;
+    struct proxy_t *proxy = &worker->proxy;
+
+    verbose ( "worker #%i started\n", worker->index );
+
+    if ( ( worker->status = proxy_task ( proxy ) ) < 0 )
+    {
+        failure ( "worker #%i failed (%i)\n", worker->index, errno );
+    }
+
+    /* Let the spawner know, it tears down remaining workers */
+    kill ( getpid (  ), SIGUSR2 );
+
+    return NULL;
+}
+
+/**
+ * Show relations statistics summed across workers
+ */
+static void show_workers_stats ( const struct worker_t *workers, int count )
+{
+    int i;
+    int state;
+    size_t a_forwarding = 0;
+    size_t b_forwarding = 0;
+    size_t a_total = 0;
+    size_t b_total = 0;
+    size_t total = 0;
+    size_t pool_size = 0;
+    const struct proxy_t *proxy;
+
+    for ( i = 0; i < count; i++ )
+    {
+        proxy = &workers[i].proxy;
+        pool_size += __atomic_load_n ( &proxy->pool_capacity, __ATOMIC_RELAXED );
+
+        a_forwarding +=
+            __atomic_load_n ( &proxy->role_count[STREAM_FORWARDING][STREAM_ROLE_A],
+            __ATOMIC_RELAXED );
+        b_forwarding +=
+            __atomic_load_n ( &proxy->role_count[STREAM_FORWARDING][STREAM_ROLE_B],
+            __ATOMIC_RELAXED );
+
+        for ( state = 0; state < STREAM_STATES; state++ )
+        {
+            a_total += __atomic_load_n ( &proxy->role_count[state][STREAM_ROLE_A],
+                __ATOMIC_RELAXED );
+            b_total += __atomic_load_n ( &proxy->role_count[state][STREAM_ROLE_B],
+                __ATOMIC_RELAXED );
+            total += __atomic_load_n ( &proxy->state_count[state], __ATOMIC_RELAXED );
+        }
+    }
+
+    info ( "load of %i workers: A:%i/%i B:%i/%i *:%i/%i\n", count, ( int ) a_forwarding,
+        ( int ) a_total, ( int ) b_forwarding, ( int ) b_total, ( int ) total, ( int ) pool_size );
+}
+
+/**
+ * Wake worker up and wait for it to finish
+ */
+static void stop_worker ( struct worker_t *worker )
+{
+    uint64_t value = 1;
+
+    if ( !worker->started )
+    {
+        return;
+    }
+
+    if ( write ( worker->proxy.stop_fd, &value, sizeof ( value ) ) < 0 )
+    {
+        failure ( "cannot signal worker #%i (%i)\n", worker->index, errno );
+    }
+
+    pthread_join ( worker->thread, NULL );
+    worker->started = 0;
+}
+
+/**
+ * Ask the busiest worker to move relations to the least busy one
+ */
+static void rebalance_workers ( struct proxy_t *proxy, struct worker_t *workers, int count,
+    uint64_t elapsed )
+{
+    int i;
+    size_t forwarded;
+    size_t shed;
+    uint64_t value = 1;
+    struct worker_t *busiest = NULL;
+    struct worker_t *idlest = NULL;
+
+    /* Sample forwarding rates since previous period */
+    for ( i = 0; i < count; i++ )
+    {
+        if ( !workers[i].started )
+        {
+            continue;
+        }
+
+        forwarded = __atomic_load_n ( &workers[i].proxy.forwarded, __ATOMIC_RELAXED );
+        workers[i].rate = ( forwarded - workers[i].sampled ) * 1000 / ( elapsed ? elapsed : 1 );
+        workers[i].sampled = forwarded;
+
+        if ( !busiest || workers[i].rate > busiest->rate )
+        {
+            busiest = &workers[i];
+        }
+
+        if ( !idlest || workers[i].rate < idlest->rate )
+        {
+            idlest = &workers[i];
+        }
+    }
+
+    /* Moving relations would defeat steering by receiving CPU */
+    if ( proxy->steering )
+    {
+        return;
+    }
+
+    /* Leave small or even differences alone */
+    if ( !busiest || busiest == idlest || busiest->rate < REBALANCE_MIN_RATE
+        || busiest->rate < 2 * idlest->rate
+        || __atomic_load_n ( &busiest->proxy.migrate_target, __ATOMIC_RELAXED ) )
+    {
+        return;
+    }
+
+    shed = ( busiest->rate - idlest->rate ) / 2;
+
+    verbose ( "moving up to %i B/s from worker #%i to worker #%i\n", ( int ) shed,
+        busiest->index, idlest->index );
+
+    /* Worker picks the request up once woken */
+    __atomic_store_n ( &busiest->proxy.migrate_rate, shed, __ATOMIC_RELAXED );
+    __atomic_store_n ( &busiest->proxy.migrate_target, &idlest->handoff, __ATOMIC_RELEASE );
+
+    if ( write ( busiest->handoff.event_fd, &value, sizeof ( value ) ) < 0 && errno != EAGAIN )
+    {
+        failure ( "cannot signal worker #%i (%i)\n", busiest->index, errno );
+    }
+}
+
+/**
+ * Spread allowed CPUs across workers, CPU goes to worker at CPU modulo count
+ */
+static void assign_worker_cpus ( struct proxy_t *proxy, struct worker_t *workers, int count )
+{
+    int cpu;
+    cpu_set_t allowed;
+    struct worker_t *worker;
+
+    if ( sched_getaffinity ( 0, sizeof ( allowed ), &allowed ) < 0 )
+    {
+        failure ( "cannot get cpu affinity (%i)\n", errno );
+        return;
+    }
+
+    for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+    {
+        if ( CPU_ISSET ( cpu, &allowed ) )
+        {
+            worker = &workers[cpu % count];
+            CPU_SET ( cpu, &worker->cpus );
+
+            if ( worker->cpu < 0 )
+            {
+                worker->cpu = cpu;
+            }
+        }
+    }
+
+    for ( cpu = 0; cpu < count; cpu++ )
+    {
+        verbose ( "worker #%i takes %i cpu(s) from cpu %i\n", cpu,
+            CPU_COUNT ( &workers[cpu].cpus ), workers[cpu].cpu );
+    }
+}
+
+/**
+ * Open listen sockets in worker order, so reuseport group index matches worker index
+ */
+static int setup_steering_listeners ( struct proxy_t *proxy, struct worker_t *workers, int count )
+{
+    int i;
+    int sock;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( ( sock = listen_socket ( &workers[i].proxy, &proxy->entrance ) ) < 0 )
+        {
+            return -1;
+        }
+
+        workers[i].proxy.listen_fd = sock;
+
+        if ( workers[i].cpu >= 0 )
+        {
+            socket_set_incoming_cpu ( proxy, sock, workers[i].cpu );
+        }
+    }
+
+    /* Selector is optional, incoming cpu hint alone steers on recent kernels */
+    socket_attach_cpu_selector ( proxy, workers[0].proxy.listen_fd, count );
+
+    return 0;
+}
+
+/* NOTE: Acceptor Thread Related Functions */
+
+/**
+ * Pick the least loaded worker, ties rotate
+ */
+static struct worker_t *pick_worker ( struct acceptor_t *acceptor )
+{
+    int i;
+    size_t load;
+    size_t best_load = ( size_t ) -1;
+    struct worker_t *worker;
+    struct worker_t *best = NULL;
+    const struct proxy_t *proxy;
+
+    acceptor->next = ( acceptor->next + 1 ) % acceptor->count;
+
+    for ( i = 0; i < acceptor->count; i++ )
+    {
+        worker = &acceptor->workers[( acceptor->next + i ) % acceptor->count];
+
+        if ( !worker->started )
+        {
+            continue;
+        }
+
+        /* Live relations plus the ones not adopted yet, two streams each */
+        proxy = &worker->proxy;
+        load = __atomic_load_n ( &proxy->state_count[STREAM_HANDSHAKE], __ATOMIC_RELAXED )
+            + __atomic_load_n ( &proxy->state_count[STREAM_FORWARDING], __ATOMIC_RELAXED )
+            + 2 * handoff_queue_len ( &worker->handoff );
+
+        if ( load < best_load )
+        {
+            best_load = load;
+            best = worker;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Resolve accepted socket destination, then hand it to a worker
+ */
+static void dispatch_relation ( struct acceptor_t *acceptor, int sock )
+{
+    int cpu;
+    struct proxy_t *proxy = &acceptor->proxy;
+    struct worker_t *worker = NULL;
+    struct handoff_t item;
+
+    item.kind = HANDOFF_ACCEPTED;
+    item.a_fd = sock;
+    item.b_fd = -1;
+    item.upstream = -1;
+
+    /* Get destination while still owning the socket */
+    if ( get_original_dest ( sock, &item.dest ) < 0 )
+    {
+        shutdown_then_close ( proxy, sock );
+        return;
+    }
+
+    /* Upstream is chosen and connected by the worker, on its own CPU */
+    /* Prefer worker pinned to the receiving CPU */
+    if ( proxy->steering && ( cpu = socket_get_incoming_cpu ( sock ) ) >= 0 )
+    {
+        worker = &acceptor->workers[cpu % acceptor->count];
+
+        if ( !worker->started || handoff_push ( &worker->handoff, &item ) < 0 )
+        {
+            worker = NULL;
+        }
+    }
+
+    if ( !worker && ( !( worker = pick_worker ( acceptor ) )
+            || handoff_push ( &worker->handoff, &item ) < 0 ) )
+    {
+        failure ( "no worker can take socket:%i, dropping\n", sock );
+        shutdown_then_close ( proxy, sock );
+        return;
+    }
+
+    verbose ( "handed socket:%i to worker #%i\n", item.a_fd, worker->index );
+}
+
+/**
+ * Accept connections until stop is requested
+ */
+static int acceptor_task ( struct acceptor_t *acceptor )
+{
+    int sock;
+    int lfd;
+    struct proxy_t *proxy = &acceptor->proxy;
+    struct pollfd fds[2];
+
+    /* Setup listen socket */
+    if ( ( lfd = listen_socket ( proxy, &proxy->entrance ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( socket_set_nonblocking ( proxy, lfd ) < 0 )
+    {
+        shutdown_then_close ( proxy, lfd );
+        return -1;
+    }
+
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = proxy->stop_fd;
+    fds[1].events = POLLIN;
+
+    for ( ;; )
+    {
+        if ( poll ( fds, 2, -1 ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            failure ( "cannot poll acceptor sockets (%i)\n", errno );
+            shutdown_then_close ( proxy, lfd );
+            return -1;
+        }
+
+        if ( fds[1].revents )
+        {
+            break;
+        }
+
+        /* Accept the whole backlog at once */
+        while ( ( sock = accept4 ( lfd, NULL, NULL, SOCK_NONBLOCK ) ) >= 0 )
+        {
+            dispatch_relation ( acceptor, sock );
+        }
+
+        if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED
+            && errno != EINTR )
+        {
+            failure ( "cannot accept incoming connection (%i) on socket:%i\n", errno, lfd );
+        }
+    }
+
+    shutdown_then_close ( proxy, lfd );
+    return 0;
+}
+
+/**
+ * Acceptor thread entry point
+ */
+static void *acceptor_main ( void *arg )
+{
+    struct acceptor_t *acceptor = ( struct acceptor_t * ) arg;
+    struct proxy_t *proxy = &acceptor->proxy;
+
+    verbose ( "acceptor started\n" );
+
+    if ( ( acceptor->status = acceptor_task ( acceptor ) ) < 0 )
+    {
+        failure ( "acceptor failed (%i)\n", errno );
+    }
+
+    /* Let the spawner know, it tears down the workers */
+    kill ( getpid (  ), SIGUSR2 );
+
+    return NULL;
+}
+
+/**
+ * Wake acceptor up and wait for it to finish
+ */
+static void stop_acceptor ( struct acceptor_t *acceptor )
+{
+    uint64_t value = 1;
+
+    if ( !acceptor->started )
+    {
+        return;
+    }
+
+    if ( write ( acceptor->proxy.stop_fd, &value, sizeof ( value ) ) < 0 )
+    {
+        failure ( "cannot signal acceptor (%i)\n", errno );
+    }
+
+    pthread_join ( acceptor->thread, NULL );
+    acceptor->started = 0;
+}
+
+/**
+ * Start acceptor thread feeding the workers
+ */
+static int start_acceptor ( struct acceptor_t *acceptor, struct proxy_t *proxy,
+    struct worker_t *workers, int count )
+{
+    acceptor->proxy = *proxy;
+    acceptor->proxy.reuseport = 0;
+    acceptor->workers = workers;
+    acceptor->count = count;
+
+    if ( ( acceptor->proxy.stop_fd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+    {
+        failure ( "cannot create stop event (%i)\n", errno );
+        return -1;
+    }
+
+    if ( pthread_create ( &acceptor->thread, NULL, acceptor_main, acceptor ) != 0 )
+    {
+        failure ( "cannot start acceptor\n" );
+        close ( acceptor->proxy.stop_fd );
+        return -1;
+    }
+
+    acceptor->started = 1;
+    return 0;
+}
+
+/* NOTE: Spawner Related Functions */
+
+/**
+ * Run proxy task in worker threads
+ */
+int run_workers ( struct proxy_t *proxy, int count )
+{
+    int i;
+    int sig;
+    int status = 0;
+    uint64_t now;
+    uint64_t stamp;
+    sigset_t set;
+    pthread_attr_t attr;
+    struct timespec period;
+    struct worker_t *workers;
+    struct acceptor_t acceptor;
+
+    memset ( &acceptor, '\0', sizeof ( acceptor ) );
+
+    if ( !( workers = ( struct worker_t * ) calloc ( count, sizeof ( struct worker_t ) ) ) )
+    {
+        failure ( "cannot allocate workers (%i)\n", errno );
+        return -1;
+    }
+
+    /* Signals are taken by this thread only, workers inherit the mask */
+    sigemptyset ( &set );
+    sigaddset ( &set, SIGINT );
+    sigaddset ( &set, SIGTERM );
+    sigaddset ( &set, SIGUSR1 );
+    sigaddset ( &set, SIGUSR2 );
+    pthread_sigmask ( SIG_BLOCK, &set, NULL );
+
+    for ( i = 0; i < count; i++ )
+    {
+        workers[i].index = i;
+        workers[i].proxy = *proxy;
+        workers[i].proxy.reuseport = !proxy->acceptor;
+        workers[i].proxy.listen_fd = -1;
+        workers[i].cpu = -1;
+        CPU_ZERO ( &workers[i].cpus );
+    }
+
+    /* Pin workers and steer flows to the worker of the receiving CPU */
+    if ( proxy->steering )
+    {
+        assign_worker_cpus ( proxy, workers, count );
+
+        if ( !proxy->acceptor && setup_steering_listeners ( proxy, workers, count ) < 0 )
+        {
+            status = -1;
+        }
+    }
+
+    for ( i = 0; i < count && !status; i++ )
+    {
+        /* Relations arrive from the acceptor or from other workers */
+        if ( handoff_queue_init ( &workers[i].handoff, HANDOFF_QUEUE_LEN ) < 0 )
+        {
+            status = -1;
+            break;
+        }
+
+        workers[i].proxy.handoff = &workers[i].handoff;
+
+        if ( ( workers[i].proxy.stop_fd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+        {
+            failure ( "cannot create stop event (%i)\n", errno );
+            handoff_queue_free ( &workers[i].handoff );
+            status = -1;
+            break;
+        }
+
+        pthread_attr_init ( &attr );
+
+        if ( proxy->steering && workers[i].cpu >= 0 )
+        {
+            pthread_attr_setaffinity_np ( &attr, sizeof ( cpu_set_t ), &workers[i].cpus );
+        }
+
+        if ( pthread_create ( &workers[i].thread, &attr, worker_main, &workers[i] ) != 0 )
+        {
+            failure ( "cannot start worker #%i\n", i );
+            pthread_attr_destroy ( &attr );
+            close ( workers[i].proxy.stop_fd );
+            handoff_queue_free ( &workers[i].handoff );
+            status = -1;
+            break;
+        }
+
+        pthread_attr_destroy ( &attr );
+        workers[i].started = 1;
+    }
+
+    info ( "started %i worker(s)\n", i );
+
+    if ( !status && proxy->acceptor && start_acceptor ( &acceptor, proxy, workers, i ) < 0 )
+    {
+        status = -1;
+    }
+
+    period.tv_sec = REBALANCE_PERIOD_MSEC / 1000;
+    period.tv_nsec = ( REBALANCE_PERIOD_MSEC % 1000 ) * 1000000;
+    stamp = get_monotonic_msec (  );
+
+    /* Wait for shutdown, stats request or a worker exit, rebalance meanwhile */
+    while ( !status )
+    {
+        if ( ( sig = sigtimedwait ( &set, NULL, &period ) ) < 0 )
+        {
+            if ( errno != EAGAIN && errno != EINTR )
+            {
+                status = -1;
+                break;
+            }
+
+            now = get_monotonic_msec (  );
+            rebalance_workers ( proxy, workers, count, now - stamp );
+            stamp = now;
+            continue;
+        }
+
+        if ( sig == SIGUSR1 )
+        {
+            show_workers_stats ( workers, count );
+            continue;
+        }
+
+        if ( sig == SIGUSR2 )
+        {
+            info ( "thread exited, stopping others...\n" );
+            status = -1;
+            break;
+        }
+
+        info ( "shutting down workers...\n" );
+        break;
+    }
+
+    show_workers_stats ( workers, count );
+
+    /* Stop feeding workers before stopping them */
+    if ( acceptor.started )
+    {
+        stop_acceptor ( &acceptor );
+        close ( acceptor.proxy.stop_fd );
+    }
+
+    if ( acceptor.status < 0 )
+    {
+        status = -1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( workers[i].started )
+        {
+            stop_worker ( &workers[i] );
+            close ( workers[i].proxy.stop_fd );
+        }
+    }
+
+    /* Workers push into each other's queues, release them after all stopped */
+    for ( i = 0; i < count; i++ )
+    {
+        handoff_queue_free ( &workers[i].handoff );
+
+        if ( workers[i].proxy.listen_fd >= 0 )
+        {
+            shutdown_then_close ( proxy, workers[i].proxy.listen_fd );
+        }
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( workers[i].status < 0 )
+        {
+            status = -1;
+        }
+    }
+
+    free ( workers );
+    return status;
+}